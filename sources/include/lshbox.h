@@ -33,8 +33,15 @@
 #include <lshbox/basis.h>
 #include <lshbox/matrix.h>
 #include <lshbox/config.h>
+#include <lshbox/mmap.h>
+#include <lshbox/writer.h>
+#include <lshbox/packfile.h>
+#include <lshbox/bucket.h>
+#include <lshbox/tombstone.h>
 #include <lshbox/filedb.h>
 #include <lshbox/metric.h>
+#include <lshbox/payload.h>
 #include <lshbox/topk.h>
 #include <lshbox/eval.h>
 #include <lshbox/lsh/itqlsh.h>
+#include <lshbox/lsh/itqsegments.h>
@@ -30,7 +30,13 @@
 #include <string>
 #include <vector>
 #include <iostream>
+#include <algorithm>
+#include <stdint.h>
 #include <time.h>
+#include <atomic>
+#include <thread>
+#include <random>
+#include <unordered_set>
 #include <direct.h>
 namespace lshbox
 {
@@ -39,41 +45,254 @@ namespace lshbox
 #define M_PI 3.14159265358979323846
 
 
+/**
+ * Packed binary hash code.
+ *
+ * Bits are stored most significant first, so that comparing two codes gives
+ * the same order as comparing their '0'/'1' string forms, and the first bits
+ * of a code can be read as an integer prefix. Codes take one word, up to 64
+ * bits, by default. Define LSHBOX_CODE_WORDS before including LSHBOX to
+ * support longer codes, at the cost of memory in every bucket directory.
+ */
+#ifndef LSHBOX_CODE_WORDS
+#define LSHBOX_CODE_WORDS 1
+#endif
+class HashCode
+{
+public:
+    static const unsigned WORDS = LSHBOX_CODE_WORDS;
+    static const unsigned MAX_BITS = 64 * LSHBOX_CODE_WORDS;
+    HashCode()
+    {
+        clear();
+    }
+    void clear()
+    {
+        for (unsigned i = 0; i != WORDS; ++i)
+        {
+            words_[i] = 0;
+        }
+    }
+    /**
+     * Number of words used by a code of the given length.
+     */
+    static unsigned words(unsigned bits)
+    {
+        return (bits + 63) / 64;
+    }
+    bool get(unsigned i) const
+    {
+        return ((words_[i >> 6] >> (63 - (i & 63))) & 1) != 0;
+    }
+    void set(unsigned i)
+    {
+        words_[i >> 6] |= uint64_t(1) << (63 - (i & 63));
+    }
+    void flip(unsigned i)
+    {
+        words_[i >> 6] ^= uint64_t(1) << (63 - (i & 63));
+    }
+    uint64_t word(unsigned i) const
+    {
+        return words_[i];
+    }
+    /**
+     * The first bits of the code as an integer, bits should not exceed 64.
+     */
+    uint64_t prefix(unsigned bits) const
+    {
+        return bits ? words_[0] >> (64 - bits) : 0;
+    }
+    /**
+     * The code with every bit from the given one on cleared.
+     */
+    HashCode truncate(unsigned bits) const
+    {
+        HashCode code(*this);
+        for (unsigned i = bits / 64; i < WORDS; ++i)
+        {
+            unsigned keep = i == bits / 64 ? bits % 64 : 0;
+            code.words_[i] = keep ? code.words_[i] & ~(~uint64_t(0) >> keep) : 0;
+        }
+        return code;
+    }
+    std::string toString(unsigned bits) const
+    {
+        std::string str(bits, '0');
+        for (unsigned i = 0; i != bits; ++i)
+        {
+            if (get(i))
+            {
+                str[i] = '1';
+            }
+        }
+        return str;
+    }
+    size_t hash() const
+    {
+        uint64_t h = 0;
+        for (unsigned i = 0; i != WORDS; ++i)
+        {
+            h = (h ^ words_[i]) * 0x9E3779B97F4A7C15ULL;
+        }
+        // short codes only fill the high bits, mix them into the low ones
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+        return size_t(h);
+    }
+    bool operator < (const HashCode &rhs) const
+    {
+        for (unsigned i = 0; i != WORDS; ++i)
+        {
+            if (words_[i] != rhs.words_[i])
+            {
+                return words_[i] < rhs.words_[i];
+            }
+        }
+        return false;
+    }
+    bool operator == (const HashCode &rhs) const
+    {
+        for (unsigned i = 0; i != WORDS; ++i)
+        {
+            if (words_[i] != rhs.words_[i])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    bool operator != (const HashCode &rhs) const
+    {
+        return !(*this == rhs);
+    }
+    void write(std::ostream &out, unsigned bits) const
+    {
+        out.write((char *)words_, sizeof(uint64_t) * words(bits));
+    }
+    void read(std::istream &in, unsigned bits)
+    {
+        clear();
+        in.read((char *)words_, sizeof(uint64_t) * words(bits));
+    }
+private:
+    uint64_t words_[LSHBOX_CODE_WORDS];
+};
+/**
+ * Convert the lowest bits of an integer to a '0'/'1' string, most significant first.
+ */
+inline std::string bitsToString(uint64_t val, unsigned bits)
+{
+    std::string str(bits, '0');
+    for (unsigned i = 0; i != bits; ++i)
+    {
+        if ((val >> (bits - 1 - i)) & 1)
+        {
+            str[i] = '1';
+        }
+    }
+    return str;
+}
+/**
+ * Generate all the codes within the given hamming distance of a code, the code
+ * itself excluded.
+ */
 class hamming_in_k
 {
 public:
-    hamming_in_k(std::string &hashVal_, unsigned hamming_): hashVal(hashVal_), hamming(hamming_) {}
-    std::vector<std::string> generateHashVals()
+    hamming_in_k(const HashCode &hashVal_, unsigned bits_, unsigned hamming_): hashVal(hashVal_), bits(bits_), hamming(hamming_) {}
+    std::vector<HashCode> generateHashVals()
     {
-        std::vector<std::string> hashVals;
-        unsigned total = unsigned(hashVal.size());
-        for (unsigned D = 1; D <= hamming; ++D)
+        std::vector<HashCode> hashVals;
+        for (unsigned D = 1; D <= hamming && D <= bits; ++D)
         {
-            generate(total, hashVals, 0, D);
+            generate(hashVals, 0, D);
         }
         return hashVals;
     }
 private:
-    std::string hashVal;
+    HashCode hashVal;
+    unsigned bits;
     unsigned hamming;
-    void generate(unsigned total, std::vector<std::string> &hashVals, unsigned S, unsigned D)
+    void generate(std::vector<HashCode> &hashVals, unsigned S, unsigned D)
     {
         if (!D)
         {
             hashVals.push_back(hashVal);
             return;
         }
-        for (unsigned i = S; i <= total - D; ++i)
+        for (unsigned i = S; i <= bits - D; ++i)
         {
-            char old_char = hashVal[i];
-            hashVal[i] = old_char == '0' ? '1' : '0';
-            generate(total, hashVals, i + 1, D - 1);
-            hashVal[i] = old_char;
+            hashVal.flip(i);
+            generate(hashVals, i + 1, D - 1);
+            hashVal.flip(i);
         }
     }
 };
 
 
+/**
+ * Run job(i, thread_id) for every i in [0, count) on at most threads threads.
+ *
+ * Jobs are handed out in ascending order of i, and thread_id is in [0, threads).
+ * When threads is not greater than 1 the jobs run in the calling thread.
+ */
+template<typename JOB>
+void parallel_for(unsigned count, unsigned threads, JOB job)
+{
+    threads = std::min(threads, count);
+    if (threads <= 1)
+    {
+        for (unsigned i = 0; i != count; ++i)
+        {
+            job(i, 0);
+        }
+        return;
+    }
+    std::atomic<unsigned> next(0);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t != threads; ++t)
+    {
+        workers.push_back(std::thread([&next, &job, count, t]()
+        {
+            for (unsigned i = next++; i < count; i = next++)
+            {
+                job(i, t);
+            }
+        }));
+    }
+    for (unsigned t = 0; t != threads; ++t)
+    {
+        workers[t].join();
+    }
+}
+/**
+ * Draw count distinct numbers from [0, N) in ascending order.
+ *
+ * Robert Floyd's algorithm draws exactly count random numbers and needs a
+ * single hash set lookup for each of them. count is clamped to N.
+ */
+template<typename RNG>
+std::vector<unsigned> sampleDistinct(unsigned count, unsigned N, RNG &rng)
+{
+    count = std::min(count, N);
+    std::unordered_set<unsigned> picked(count * 2);
+    std::vector<unsigned> seqs;
+    seqs.reserve(count);
+    for (unsigned j = N - count; j != N; ++j)
+    {
+        unsigned target = std::uniform_int_distribution<unsigned>(0, j)(rng);
+        if (!picked.insert(target).second)
+        {
+            target = j;
+            picked.insert(target);
+        }
+        seqs.push_back(target);
+    }
+    std::sort(seqs.begin(), seqs.end());
+    return seqs;
+}
 /**
  * Sort std::vector<std::pair<unsigned, float> > by the second value.
  */
@@ -0,0 +1,807 @@
+//////////////////////////////////////////////////////////////////////////////
+/// Copyright (C) 2014 Gefu Tang <tanggefu@gmail.com>. All Rights Reserved.
+///
+/// This file is part of LSHBOX.
+///
+/// LSHBOX is free software: you can redistribute it and/or modify it under
+/// the terms of the GNU General Public License as published by the Free
+/// Software Foundation, either version 3 of the License, or(at your option)
+/// any later version.
+///
+/// LSHBOX is distributed in the hope that it will be useful, but WITHOUT
+/// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+/// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+/// more details.
+///
+/// You should have received a copy of the GNU General Public License along
+/// with LSHBOX. If not, see <http://www.gnu.org/licenses/>.
+///
+/// @version 0.1
+/// @author Gefu Tang & Zhifeng Xiao
+/// @date 2014.6.30
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @file bucket.h
+ *
+ * @brief Frozen bucket storage of a hash table.
+ */
+#pragma once
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <ostream>
+#include <stdint.h>
+namespace lshbox
+{
+/**
+ * A contiguous array that either owns its elements or refers to elements
+ * owned by someone else, such as a mapped index file.
+ *
+ * A referred array is copied into owned storage the first time it is
+ * modified, so mapped memory is never written.
+ */
+template<typename T>
+class Array
+{
+public:
+    Array(): data_(NULL), size_(0) {}
+    Array(const Array &rhs): owned_(rhs.owned_), data_(rhs.data_), size_(rhs.size_)
+    {
+        if (rhs.isOwner())
+        {
+            data_ = owned_.data();
+        }
+    }
+    Array &operator = (const Array &rhs)
+    {
+        if (this != &rhs)
+        {
+            owned_ = rhs.owned_;
+            data_ = rhs.isOwner() ? owned_.data() : rhs.data_;
+            size_ = rhs.size_;
+        }
+        return *this;
+    }
+    /**
+     * Refer to size elements at data, which must outlive the array.
+     */
+    void view(const T *data, size_t size)
+    {
+        std::vector<T>().swap(owned_);
+        data_ = const_cast<T *>(data);
+        size_ = size;
+    }
+    void reserve(size_t size)
+    {
+        detach();
+        owned_.reserve(size);
+        bind();
+    }
+    void resize(size_t size)
+    {
+        detach();
+        owned_.resize(size);
+        bind();
+    }
+    void assign(size_t size, const T &val)
+    {
+        std::vector<T>(size, val).swap(owned_);
+        bind();
+    }
+    void push_back(const T &val)
+    {
+        detach();
+        owned_.push_back(val);
+        bind();
+    }
+    /**
+     * Take the elements of vec, which is left empty.
+     */
+    void swap(std::vector<T> &vec)
+    {
+        std::vector<T>().swap(owned_);
+        owned_.swap(vec);
+        bind();
+    }
+    /**
+     * Release the elements.
+     */
+    void clear()
+    {
+        std::vector<T>().swap(owned_);
+        bind();
+    }
+    T *data()
+    {
+        detach();
+        return data_;
+    }
+    const T *data() const
+    {
+        return data_;
+    }
+    T &operator [] (size_t i)
+    {
+        detach();
+        return data_[i];
+    }
+    const T &operator [] (size_t i) const
+    {
+        return data_[i];
+    }
+    size_t size() const
+    {
+        return size_;
+    }
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+private:
+    bool isOwner() const
+    {
+        return data_ == owned_.data() && size_ == owned_.size();
+    }
+    void bind()
+    {
+        data_ = owned_.data();
+        size_ = owned_.size();
+    }
+    void detach()
+    {
+        if (!isOwner())
+        {
+            std::vector<T>(data_, data_ + size_).swap(owned_);
+            bind();
+        }
+    }
+    std::vector<T> owned_;
+    T *data_;
+    size_t size_;
+};
+/// Alignment of the arrays in an index file
+const size_t INDEX_ALIGN = 64;
+/**
+ * Write bytes to an index file at the next multiple of INDEX_ALIGN from its start.
+ */
+inline void writeAligned(std::ostream &out, const void *data, size_t bytes)
+{
+    static const char zeros[INDEX_ALIGN] = {0};
+    size_t pos = size_t(out.tellp());
+    out.write(zeros, (INDEX_ALIGN - pos % INDEX_ALIGN) % INDEX_ALIGN);
+    out.write((const char *)data, bytes);
+}
+/**
+ * The count elements written by writeAligned() after offset in a mapped index
+ * file, offset is moved past them.
+ *
+ * @return NULL if the file is too short
+ */
+template<typename T>
+const T *viewAligned(const char *base, size_t size, size_t &offset, size_t count)
+{
+    offset = (offset + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+    if (offset > size || count > (size - offset) / sizeof(T))
+    {
+        return NULL;
+    }
+    const T *data = (const T *)(base + offset);
+    offset += sizeof(T) * count;
+    return data;
+}
+/**
+ * The buckets of one hash table in compressed sparse row form.
+ *
+ * The codes of the non-empty buckets are kept sorted in one array, and the
+ * keys of bucket b are ids[offsets[b] .. offsets[b + 1]) in a single array
+ * shared by all the buckets, so a table costs a few allocations whatever its
+ * number of buckets.
+ *
+ * Codes are looked up in an open addressing directory with linear probing,
+ * kept at most half full. Each slot holds a tag from the hash of the code next
+ * to the bucket index, so a missing code is usually rejected at the first
+ * empty slot without touching the codes. Short codes use a direct directory
+ * instead, an array indexed by the code itself, where any lookup is a single
+ * load. A bucket also records where its vectors are stored in the bucket files.
+ *
+ * The codes may be longer than the bits the directory is built on, e.g. ITQ
+ * codes extended with a few extra bits. The buckets whose codes share their
+ * first bits then form a group found through the directory, and a lookup
+ * scans the whole group unless it holds more than the split threshold of
+ * keys, in which case it only scans the bucket of the full code.
+ *
+ * The keys can be compressed by compress(). The keys of a bucket are ascending,
+ * so they are stored as the first key followed by the gaps between keys, bit
+ * packed in blocks of PACK_BLOCK gaps with the width of the largest gap of the
+ * block, and decoded by decode(). The gaps of a full block are laid out in
+ * interleaved lanes, so that they are unpacked with vector instructions.
+ *
+ * The arrays of a table can be written to an index file and used in place
+ * from a mapping of that file, they are only copied if the table is modified.
+ */
+class BucketTable
+{
+public:
+    BucketTable(): mask_(0), bits_(0), splitMax_(0) {}
+    /**
+     * Build the table from the buckets of table, which is emptied.
+     *
+     * @param table The buckets of the codes
+     * @param bits  Number of first bits of the codes the directory is built on
+     */
+    void assign(std::map<HashCode, std::vector<unsigned> > &table, unsigned bits)
+    {
+        size_t total = 0;
+        for (auto iter = table.begin(); iter != table.end(); ++iter)
+        {
+            total += iter->second.size();
+        }
+        clear();
+        reserve(unsigned(table.size()), total);
+        for (auto iter = table.begin(); iter != table.end(); ++iter)
+        {
+            std::copy(iter->second.begin(), iter->second.end(), append(iter->first, unsigned(iter->second.size())));
+            std::vector<unsigned>().swap(iter->second);
+        }
+        table.clear();
+        index(bits);
+    }
+    void reserve(unsigned buckets, size_t keys)
+    {
+        codes_.reserve(buckets);
+        offsets_.reserve(buckets + 1);
+        ids_.reserve(keys);
+    }
+    /**
+     * Add a bucket of length keys after the last one, codes must be appended
+     * in ascending order.
+     *
+     * @return Where the keys of the bucket are to be written
+     */
+    unsigned *append(const HashCode &code, unsigned length)
+    {
+        if (offsets_.empty())
+        {
+            offsets_.push_back(0);
+        }
+        codes_.push_back(code);
+        ids_.resize(ids_.size() + length);
+        offsets_.push_back(unsigned(ids_.size()));
+        return ids_.data() + offsets_[offsets_.size() - 2];
+    }
+    /**
+     * Build the directory of the buckets, after the last append().
+     *
+     * A direct directory is used when the directory has at most DIRECT_BITS
+     * bits, or at most DIRECT_MAX_BITS bits and the array takes no more than
+     * four times the memory of the hashed directory.
+     *
+     * @param bits Number of first bits of the codes the directory is built on
+     */
+    void index(unsigned bits)
+    {
+        bits_ = bits;
+        std::vector<unsigned> groups;
+        for (unsigned b = 0; b != size(); ++b)
+        {
+            if (b == 0 || codes_[b].truncate(bits) != codes_[b - 1].truncate(bits))
+            {
+                groups.push_back(b);
+            }
+        }
+        groups.push_back(size());
+        if (groups.size() == size_t(size()) + 1)
+        {
+            groups.clear();
+        }
+        groups_.swap(groups);
+        unsigned capacity = 16;
+        while (capacity < 2 * groupCount())
+        {
+            capacity *= 2;
+        }
+        direct_.clear();
+        slots_.clear();
+        if (bits <= DIRECT_BITS || (bits <= DIRECT_MAX_BITS && (size_t(1) << bits) * sizeof(unsigned) <= 4 * capacity * sizeof(uint64_t)))
+        {
+            direct_.assign(size_t(1) << bits, 0);
+            for (unsigned g = 0; g != groupCount(); ++g)
+            {
+                direct_[size_t(codes_[groupBegin(g)].prefix(bits))] = g + 1;
+            }
+        }
+        else
+        {
+            mask_ = capacity - 1;
+            slots_.assign(capacity, 0);
+            for (unsigned g = 0; g != groupCount(); ++g)
+            {
+                uint64_t h = codes_[groupBegin(g)].truncate(bits).hash();
+                unsigned i = unsigned(h) & mask_;
+                while (slots_[i] != 0)
+                {
+                    i = (i + 1) & mask_;
+                }
+                slots_[i] = (h & TAG_MASK) | (g + 1);
+            }
+        }
+        files_.assign(size(), 0);
+        positions_.assign(size(), 0);
+    }
+    /**
+     * Scan only the bucket of the full code in the groups holding more than
+     * max keys, 0 always scans the whole group.
+     */
+    void setSplitMax(unsigned max)
+    {
+        splitMax_ = max;
+    }
+    unsigned getSplitMax() const
+    {
+        return splitMax_;
+    }
+    /**
+     * Record that the vectors of bucket b start at pos in bucket file file.
+     */
+    void locate(unsigned b, unsigned file, unsigned pos)
+    {
+        files_[b] = file;
+        positions_[b] = pos;
+    }
+    /**
+     * Move the buckets into table for updates, this table is left empty.
+     */
+    void extract(std::map<HashCode, std::vector<unsigned> > &table)
+    {
+        for (unsigned b = 0; b != size(); ++b)
+        {
+            std::vector<unsigned> &keys = table[code(b)];
+            keys.resize(keys.size() + length(b));
+            decode(b, &keys[keys.size() - length(b)]);
+        }
+        clear();
+    }
+    /**
+     * Compress the keys, which are then read with decode() only.
+     */
+    void compress()
+    {
+        if (compressed() || empty())
+        {
+            return;
+        }
+        std::vector<uint32_t> words;
+        std::vector<unsigned> starts(size() + 1);
+        words.reserve(ids_.size() / 2);
+        for (unsigned b = 0; b != size(); ++b)
+        {
+            starts[b] = unsigned(words.size());
+            pack(begin(b), length(b), words);
+        }
+        starts[size()] = unsigned(words.size());
+        packed_.swap(words);
+        packedOffsets_.swap(starts);
+        ids_.clear();
+    }
+    /**
+     * Whether the keys are compressed.
+     */
+    bool compressed() const
+    {
+        return !packedOffsets_.empty();
+    }
+    void clear()
+    {
+        codes_.clear();
+        offsets_.clear();
+        ids_.clear();
+        packed_.clear();
+        packedOffsets_.clear();
+        groups_.clear();
+        slots_.clear();
+        direct_.clear();
+        files_.clear();
+        positions_.clear();
+    }
+    /**
+     * Write the table to an index file, with every array aligned so that
+     * view() can use it in place.
+     */
+    void write(std::ostream &out) const
+    {
+        uint64_t header[] = {codes_.size(), ids_.size(), packed_.size(), packedOffsets_.size(), groups_.size(),
+                             slots_.size(), direct_.size(), mask_, bits_, splitMax_
+                            };
+        writeAligned(out, header, sizeof(header));
+        writeAligned(out, codes_.data(), sizeof(HashCode) * codes_.size());
+        writeAligned(out, offsets_.data(), sizeof(unsigned) * offsets_.size());
+        writeAligned(out, ids_.data(), sizeof(unsigned) * ids_.size());
+        writeAligned(out, packed_.data(), sizeof(uint32_t) * packed_.size());
+        writeAligned(out, packedOffsets_.data(), sizeof(unsigned) * packedOffsets_.size());
+        writeAligned(out, groups_.data(), sizeof(unsigned) * groups_.size());
+        writeAligned(out, slots_.data(), sizeof(uint64_t) * slots_.size());
+        writeAligned(out, direct_.data(), sizeof(unsigned) * direct_.size());
+        writeAligned(out, files_.data(), sizeof(unsigned) * files_.size());
+        writeAligned(out, positions_.data(), sizeof(unsigned) * positions_.size());
+    }
+    /**
+     * Use in place a table written by write() into a mapped index file.
+     *
+     * @param  base   Start of the index file
+     * @param  size   Size of the index file
+     * @param  offset Offset of the table in the file, moved past it
+     * @return        False if the file is too short
+     */
+    bool view(const char *base, size_t size, size_t &offset)
+    {
+        clear();
+        const uint64_t *header = viewAligned<uint64_t>(base, size, offset, 10);
+        if (header == NULL)
+        {
+            return false;
+        }
+        size_t buckets = size_t(header[0]);
+        size_t keys = size_t(header[1]);
+        mask_ = unsigned(header[7]);
+        bits_ = unsigned(header[8]);
+        splitMax_ = unsigned(header[9]);
+        const HashCode *codes = viewAligned<HashCode>(base, size, offset, buckets);
+        const unsigned *offsets = viewAligned<unsigned>(base, size, offset, buckets ? buckets + 1 : 0);
+        const unsigned *ids = viewAligned<unsigned>(base, size, offset, keys);
+        const uint32_t *packed = viewAligned<uint32_t>(base, size, offset, size_t(header[2]));
+        const unsigned *packedOffsets = viewAligned<unsigned>(base, size, offset, size_t(header[3]));
+        const unsigned *groups = viewAligned<unsigned>(base, size, offset, size_t(header[4]));
+        const uint64_t *slots = viewAligned<uint64_t>(base, size, offset, size_t(header[5]));
+        const unsigned *direct = viewAligned<unsigned>(base, size, offset, size_t(header[6]));
+        const unsigned *files = viewAligned<unsigned>(base, size, offset, buckets);
+        const unsigned *positions = viewAligned<unsigned>(base, size, offset, buckets);
+        if (positions == NULL || files == NULL || direct == NULL || slots == NULL || groups == NULL || packedOffsets == NULL
+                || packed == NULL || ids == NULL || offsets == NULL || codes == NULL)
+        {
+            return false;
+        }
+        codes_.view(codes, buckets);
+        offsets_.view(offsets, buckets ? buckets + 1 : 0);
+        ids_.view(ids, keys);
+        packed_.view(packed, size_t(header[2]));
+        packedOffsets_.view(packedOffsets, size_t(header[3]));
+        groups_.view(groups, size_t(header[4]));
+        slots_.view(slots, size_t(header[5]));
+        direct_.view(direct, size_t(header[6]));
+        files_.view(files, buckets);
+        positions_.view(positions, buckets);
+        return true;
+    }
+    /**
+     * Number of non-empty buckets.
+     */
+    unsigned size() const
+    {
+        return unsigned(codes_.size());
+    }
+    bool empty() const
+    {
+        return codes_.empty();
+    }
+    /**
+     * Index of the bucket of code, -1 if it is empty.
+     */
+    int find(const HashCode &code) const
+    {
+        int g = findGroup(code);
+        if (g < 0)
+        {
+            return -1;
+        }
+        if (groups_.empty())
+        {
+            return codes_[g] == code ? g : -1;
+        }
+        const HashCode *first = codes_.data() + groupBegin(g);
+        const HashCode *last = codes_.data() + groupBegin(g + 1);
+        const HashCode *iter = std::lower_bound(first, last, code);
+        return iter != last && *iter == code ? int(iter - codes_.data()) : -1;
+    }
+    /**
+     * The buckets [first, last) to scan for code: the group of its first bits,
+     * or only its own bucket if the group is split.
+     *
+     * @return False if there is nothing to scan
+     */
+    bool probe(const HashCode &code, unsigned &first, unsigned &last) const
+    {
+        int g = findGroup(code);
+        if (g < 0)
+        {
+            return false;
+        }
+        first = groupBegin(g);
+        last = groupBegin(g + 1);
+        if (last - first > 1 && splitMax_ != 0 && offsets_[last] - offsets_[first] > splitMax_)
+        {
+            int b = find(code);
+            if (b < 0)
+            {
+                return false;
+            }
+            first = unsigned(b);
+            last = first + 1;
+        }
+        return true;
+    }
+    const HashCode &code(unsigned b) const
+    {
+        return codes_[b];
+    }
+    /**
+     * Position of the first key of bucket b among the keys of the table.
+     */
+    unsigned offset(unsigned b) const
+    {
+        return offsets_[b];
+    }
+    /**
+     * Number of keys in bucket b.
+     */
+    unsigned length(unsigned b) const
+    {
+        return offsets_[b + 1] - offsets_[b];
+    }
+    /**
+     * The keys of bucket b, decoded into buffer if they are compressed.
+     */
+    const unsigned *decode(unsigned b, std::vector<unsigned> &buffer) const
+    {
+        if (!compressed())
+        {
+            return begin(b);
+        }
+        buffer.resize(length(b));
+        decode(b, buffer.data());
+        return buffer.data();
+    }
+    /**
+     * Copy the keys of bucket b to keys.
+     */
+    void decode(unsigned b, unsigned *keys) const
+    {
+        if (compressed())
+        {
+            unpack(packed_.data() + packedOffsets_[b], length(b), keys);
+        }
+        else
+        {
+            std::copy(begin(b), end(b), keys);
+        }
+    }
+    /**
+     * The keys of bucket b, only if they are not compressed.
+     */
+    const unsigned *begin(unsigned b) const
+    {
+        return ids_.data() + offsets_[b];
+    }
+    const unsigned *end(unsigned b) const
+    {
+        return ids_.data() + offsets_[b + 1];
+    }
+    /**
+     * Bucket file holding the vectors of bucket b.
+     */
+    unsigned file(unsigned b) const
+    {
+        return files_[b];
+    }
+    /**
+     * Position of the first vector of bucket b in its bucket file.
+     */
+    unsigned position(unsigned b) const
+    {
+        return positions_[b];
+    }
+    /**
+     * Number of keys in all the buckets.
+     */
+    unsigned keys() const
+    {
+        return offsets_.empty() ? 0 : offsets_[size()];
+    }
+private:
+    unsigned groupCount() const
+    {
+        return groups_.empty() ? size() : unsigned(groups_.size() - 1);
+    }
+    /**
+     * First bucket of group g.
+     */
+    unsigned groupBegin(unsigned g) const
+    {
+        return groups_.empty() ? g : groups_[g];
+    }
+    /**
+     * Index of the group of the first bits_ bits of code, -1 if it is empty.
+     */
+    int findGroup(const HashCode &code) const
+    {
+        if (!direct_.empty())
+        {
+            return int(direct_[size_t(code.prefix(bits_))]) - 1;
+        }
+        if (slots_.empty())
+        {
+            return -1;
+        }
+        HashCode key = code.truncate(bits_);
+        uint64_t h = key.hash();
+        for (unsigned i = unsigned(h) & mask_;; i = (i + 1) & mask_)
+        {
+            uint64_t slot = slots_[i];
+            if (slot == 0)
+            {
+                return -1;
+            }
+            if ((slot & TAG_MASK) == (h & TAG_MASK) && codes_[groupBegin(unsigned(slot) - 1)].truncate(bits_) == key)
+            {
+                return int(unsigned(slot) - 1);
+            }
+        }
+    }
+    /// Number of gaps packed with the same width
+    static const unsigned PACK_BLOCK = 128;
+    /// Lanes of a full block, decoded side by side
+    static const unsigned PACK_LANES = 4;
+    static unsigned bitWidth(uint32_t val)
+    {
+        unsigned width = 0;
+        for (; val != 0; val >>= 1)
+        {
+            ++width;
+        }
+        return width;
+    }
+    /**
+     * Append the ascending keys[0 .. count) to words, as the first key then
+     * blocks of gaps minus one, each block after a word holding its bit width.
+     *
+     * A full block of PACK_BLOCK gaps takes width words per lane: gap i is in
+     * lane i % PACK_LANES at row i / PACK_LANES, and the words of the lanes
+     * are interleaved, so the lanes are decoded together with the same shifts.
+     * The last block, if shorter, packs its gaps one after another.
+     */
+    static void pack(const unsigned *keys, unsigned count, std::vector<uint32_t> &words)
+    {
+        if (count == 0)
+        {
+            return;
+        }
+        words.push_back(keys[0]);
+        for (unsigned first = 1; first < count; first += PACK_BLOCK)
+        {
+            unsigned last = std::min(count, first + PACK_BLOCK);
+            unsigned width = 0;
+            for (unsigned i = first; i != last; ++i)
+            {
+                width = std::max(width, bitWidth(keys[i] - keys[i - 1] - 1));
+            }
+            words.push_back(width);
+            size_t base = words.size();
+            bool full = last - first == PACK_BLOCK;
+            words.resize(base + (size_t(last - first) * width + 31) / 32, 0);
+            for (unsigned i = first; i != last; ++i)
+            {
+                uint32_t gap = keys[i] - keys[i - 1] - 1;
+                unsigned lane = full ? (i - first) % PACK_LANES : 0;
+                size_t bit = size_t(full ? (i - first) / PACK_LANES : i - first) * width;
+                unsigned shift = unsigned(bit & 31);
+                size_t word = full ? base + (bit >> 5) * PACK_LANES + lane : base + (bit >> 5);
+                size_t step = full ? PACK_LANES : 1;
+                words[word] |= gap << shift;
+                if (shift + width > 32)
+                {
+                    words[word + step] |= gap >> (32 - shift);
+                }
+            }
+        }
+    }
+    /**
+     * Decode count keys packed by pack() into keys.
+     */
+    static void unpack(const uint32_t *words, unsigned count, unsigned *keys)
+    {
+        if (count == 0)
+        {
+            return;
+        }
+        unsigned key = keys[0] = *words++;
+        for (unsigned first = 1; first < count; first += PACK_BLOCK)
+        {
+            unsigned last = std::min(count, first + PACK_BLOCK);
+            unsigned width = *words++;
+            if (last - first == PACK_BLOCK)
+            {
+                unpackBlock(words, width, keys + first);
+                for (unsigned i = first; i != last; ++i)
+                {
+                    key += keys[i] + 1;
+                    keys[i] = key;
+                }
+                words += size_t(width) * PACK_LANES;
+                continue;
+            }
+            uint64_t mask = (uint64_t(1) << width) - 1;
+            for (unsigned i = first; i != last; ++i)
+            {
+                size_t bit = size_t(i - first) * width;
+                unsigned shift = unsigned(bit & 31);
+                const uint32_t *word = words + (bit >> 5);
+                uint64_t bits = word[0];
+                if (shift + width > 32)
+                {
+                    bits |= uint64_t(word[1]) << 32;
+                }
+                key += unsigned((bits >> shift) & mask) + 1;
+                keys[i] = key;
+            }
+            words += (size_t(last - first) * width + 31) / 32;
+        }
+    }
+    /**
+     * Decode the gaps of a full block into gaps. Every row shifts and masks
+     * the PACK_LANES lanes alike, which compilers turn into vector operations.
+     */
+    static void unpackBlock(const uint32_t *words, unsigned width, unsigned *gaps)
+    {
+        uint32_t mask = width == 32 ? ~uint32_t(0) : (uint32_t(1) << width) - 1;
+        for (unsigned row = 0; row != PACK_BLOCK / PACK_LANES; ++row)
+        {
+            unsigned bit = row * width;
+            unsigned shift = bit & 31;
+            const uint32_t *word = words + (bit >> 5) * PACK_LANES;
+            unsigned *out = gaps + row * PACK_LANES;
+            if (width == 0)
+            {
+                for (unsigned lane = 0; lane != PACK_LANES; ++lane)
+                {
+                    out[lane] = 0;
+                }
+            }
+            else if (shift + width <= 32)
+            {
+                for (unsigned lane = 0; lane != PACK_LANES; ++lane)
+                {
+                    out[lane] = (word[lane] >> shift) & mask;
+                }
+            }
+            else
+            {
+                for (unsigned lane = 0; lane != PACK_LANES; ++lane)
+                {
+                    out[lane] = ((word[lane] >> shift) | (word[lane + PACK_LANES] << (32 - shift))) & mask;
+                }
+            }
+        }
+    }
+    static const uint64_t TAG_MASK = 0xFFFFFFFF00000000ULL;
+    /// Codes up to DIRECT_BITS always have a direct directory, up to 4MB
+    static const unsigned DIRECT_BITS = 20;
+    /// Longest codes with a direct directory, 2^24 buckets take 64MB
+    static const unsigned DIRECT_MAX_BITS = 24;
+    Array<HashCode> codes_;
+    Array<unsigned> offsets_;
+    Array<unsigned> ids_;
+    /// Compressed keys, those of bucket b start at packed_[packedOffsets_[b]]
+    Array<uint32_t> packed_;
+    Array<unsigned> packedOffsets_;
+    /// First bucket of every group and one past the last bucket, empty if every group has one bucket
+    Array<unsigned> groups_;
+    Array<uint64_t> slots_;
+    unsigned mask_;
+    /// Group index + 1 of every code of bits_ bits, 0 for empty groups
+    Array<unsigned> direct_;
+    unsigned bits_;
+    unsigned splitMax_;
+    Array<unsigned> files_;
+    Array<unsigned> positions_;
+};
+}
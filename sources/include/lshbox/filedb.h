@@ -32,56 +32,117 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
 #include <assert.h>
 #include <string.h>
 namespace lshbox
 {
 /**
- * Dataset management class. A dataset is maintained as a matrix in memory.
+ * Dataset management class. A dataset is maintained as a set of batch files on disk.
  *
  * The file contains N D-dimensional vectors of single precision floating point numbers.
  *
  * Such binary files can be accessed using lshbox::Matrix<double>.
+ *
+ * By default the vectors are read with file streams. With use_mmap, every batch
+ * file is memory mapped and the vectors are accessed in place without copy.
  */
 template<typename T>
 class FileDB
 {
 private:
     int dim, N, batch, batch_N;
+    std::string db_path;
     std::vector<std::ifstream> infs;
+    std::vector<MappedFile *> maps;
+    std::vector<T> current;
+    /**
+     * getRows() reads through gaps up to GATHER_GAP bytes, in spans up to GATHER_SPAN bytes.
+     */
+    static const size_t GATHER_GAP = 64 << 10;
+    static const size_t GATHER_SPAN = 4 << 20;
 public:
-    FileDB() {}
-    FileDB(std::string path)
+    FileDB(): batch_N(0) {}
+    FileDB(std::string path, bool use_mmap = false): batch_N(0)
+    {
+        load(path, use_mmap);
+    }
+    ~FileDB()
+    {
+        close();
+    }
+    void load(std::string path, bool use_mmap = false)
     {
+        close();
         op_config ocf(path + "/dataset/data.meta");
         reset(std::stoi(ocf.get_value("DIMENSIONS")),
               std::stoi(ocf.get_value("TOTAL_SIZE")),
               std::stoi(ocf.get_value("BATCH_SIZE")));
+        db_path = path;
         for (int i = 0; i != batch_N; ++i)
         {
-            std::string db_file = path + "/dataset/data_" + std::to_string(long double(i)) + ".bin";
-            infs[i].open(db_file, std::ios::binary);
+            if (use_mmap)
+            {
+                maps.push_back(new MappedFile);
+                if (!maps[i]->open(getBatchFile(i)))
+                {
+                    std::cout << "map error: " << getBatchFile(i) << std::endl;
+                }
+            }
+            else
+            {
+                infs[i].open(getBatchFile(i), std::ios::binary);
+            }
         }
     }
-    ~FileDB()
+    void close()
     {
-        for (int i = 0; i != batch_N; ++i)
+        for (unsigned i = 0; i != infs.size(); ++i)
         {
             infs[i].close();
         }
+        for (unsigned i = 0; i != maps.size(); ++i)
+        {
+            delete maps[i];
+        }
+        maps.clear();
     }
-    void load(std::string path)
+    /**
+     * Whether the batch files are memory mapped.
+     */
+    bool isMapped() const
     {
-        op_config ocf(path + "/dataset/data.meta");
-        reset(std::stoi(ocf.get_value("DIMENSIONS")),
-              std::stoi(ocf.get_value("TOTAL_SIZE")),
-              std::stoi(ocf.get_value("BATCH_SIZE")));
-        for (int i = 0; i != batch_N; ++i)
+        return !maps.empty();
+    }
+    /**
+     * Tell the kernel how the mapped vectors will be accessed, e.g.
+     * MappedFile::RANDOM while training or querying and MappedFile::SEQUENTIAL
+     * while hashing. It does nothing if the batch files are not mapped.
+     */
+    void advise(MappedFile::Advice advice)
+    {
+        for (unsigned i = 0; i != maps.size(); ++i)
         {
-            std::string db_file = path + "/dataset/data_" + std::to_string(long double(i)) + ".bin";
-            infs[i].open(db_file, std::ios::binary);
+            maps[i]->advise(advice);
         }
     }
+    /**
+     * Pointer to the ith vector in the mapped batch files.
+     */
+    const T *mapped(unsigned ith) const
+    {
+        return (const T *)maps[ith / batch]->data() + size_t(ith % batch) * dim;
+    }
+    /**
+     * Path of the ith batch file.
+     */
+    std::string getBatchFile(int i) const
+    {
+        return db_path + "/dataset/data_" + std::to_string(long double(i)) + ".bin";
+    }
     /**
      * Reset the size.
      *
@@ -102,6 +163,10 @@ public:
     }
     std::vector<T> getIthVec(unsigned ith)
     {
+        if (isMapped())
+        {
+            return std::vector<T>(mapped(ith), mapped(ith) + dim);
+        }
         std::vector<T> vec_(dim);
         int ith_db = ith / batch;
         ith %= batch;
@@ -111,11 +176,67 @@ public:
     }
     /**
      *
-     * Access the ith vector.
+     * Access the ith vector. If the batch files are mapped the pointer stays
+     * valid as long as the FileDB, otherwise it is valid until the next access.
+     */
+    const T *operator [] (unsigned i)
+    {
+        if (isMapped())
+        {
+            return mapped(i);
+        }
+        current = getIthVec(i);
+        return &current[0];
+    }
+    /**
+     * Copy the vectors ids[0 .. count) into rows, one row after another.
+     *
+     * Ascending ids that are close to each other in the same batch file are
+     * fetched with one read of the whole span, so a sorted sample costs a few
+     * large reads instead of one seek and read per vector.
      */
-    T *operator [] (unsigned i)
+    void getRows(const unsigned *ids, unsigned count, T *rows)
     {
-        return &getIthVec(i)[0];
+        const size_t bytes = sizeof(T) * dim;
+        if (isMapped())
+        {
+            for (unsigned i = 0; i != count; ++i)
+            {
+                memcpy(rows + size_t(i) * dim, mapped(ids[i]), bytes);
+            }
+            return;
+        }
+        const unsigned gap = std::max(1u, unsigned(GATHER_GAP / bytes));
+        const unsigned span = std::max(1u, unsigned(GATHER_SPAN / bytes));
+        std::vector<T> buffer;
+        for (unsigned i = 0; i != count;)
+        {
+            unsigned first = ids[i];
+            unsigned last = first;
+            unsigned j = i + 1;
+            while (j != count && ids[j] >= last && ids[j] - last <= gap
+                    && ids[j] / batch == first / batch && ids[j] - first < span)
+            {
+                last = ids[j++];
+            }
+            int ith_db = first / batch;
+            infs[ith_db].clear();
+            infs[ith_db].seekg(std::streamoff(bytes) * (first % batch), std::ios::beg);
+            if (j == i + 1)
+            {
+                infs[ith_db].read((char *)(rows + size_t(i) * dim), bytes);
+            }
+            else
+            {
+                buffer.resize(size_t(last - first + 1) * dim);
+                infs[ith_db].read((char *)&buffer[0], std::streamsize(bytes) * (last - first + 1));
+                for (unsigned k = i; k != j; ++k)
+                {
+                    memcpy(rows + size_t(k) * dim, &buffer[size_t(ids[k] - first) * dim], bytes);
+                }
+            }
+            i = j;
+        }
     }
     /**
      * Get the dimension.
@@ -131,6 +252,13 @@ public:
     {
         return N;
     }
+    /**
+     * Get the number of vectors in each batch file.
+     */
+    unsigned getBatch() const
+    {
+        return batch;
+    }
     /**
      * An accessor class to be used with LSH index.
      */
@@ -138,6 +266,7 @@ public:
     {
         FileDB &file_db_;
         std::vector<bool> flags_;
+        std::vector<T> vec_;
     public:
         typedef unsigned Key;
         typedef const T *Value;
@@ -160,9 +289,224 @@ public:
             flags_[key] = true;
             return true;
         }
-        T *operator () (unsigned key)
+        const T *operator () (unsigned key)
+        {
+            if (file_db_.isMapped())
+            {
+                return file_db_.mapped(key);
+            }
+            vec_ = file_db_.getIthVec(key);
+            return &vec_[0];
+        }
+    };
+    /**
+     * Sequential reader over a range of vectors.
+     *
+     * The batch files are read with large reads into a reusable buffer instead
+     * of one seek and read per vector. With read-ahead, a single background
+     * thread reads the next chunk into the second of two buffers while the
+     * caller processes the current one.
+     *
+     * Usage:
+     *
+     * @code
+     * FileDB<float>::Reader reader(data, 0, data.getSize());
+     * const float *vecs;
+     * for (unsigned n = reader.next(vecs); n != 0; n = reader.next(vecs))
+     * {
+     *     // vecs[0 .. n * dim) are the vectors from reader.position()
+     * }
+     * @endcode
+     */
+    class Reader
+    {
+    public:
+        /**
+         * @param file_db    The dataset
+         * @param begin      The first vector to read
+         * @param end        One past the last vector to read
+         * @param chunk      Vectors per read, 0 means about 4MB
+         * @param read_ahead Read the next chunk in a background thread
+         */
+        Reader(FileDB &file_db, unsigned begin, unsigned end, unsigned chunk = 0, bool read_ahead = false)
+            : file_db_(file_db), next_(begin), end_(end), pos_(begin), chunk_(chunk), read_ahead_(read_ahead), open_(-1)
+        {
+            if (chunk_ == 0)
+            {
+                chunk_ = std::max(1u, unsigned((4 << 20) / (sizeof(T) * file_db_.getDim())));
+            }
+            counts_[0] = counts_[1] = 0;
+            front_ = 0;
+            ready_ = stop_ = false;
+            if (file_db_.isMapped())
+            {
+                read_ahead_ = false;
+                return;
+            }
+            buffers_[0].resize(size_t(chunk_) * file_db_.getDim());
+            buffers_[1].resize(size_t(chunk_) * file_db_.getDim());
+            if (read_ahead_)
+            {
+                thread_ = std::thread(&Reader::prefetch, this);
+            }
+        }
+        ~Reader()
+        {
+            if (thread_.joinable())
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    stop_ = true;
+                }
+                cond_.notify_all();
+                thread_.join();
+            }
+        }
+        /**
+         * Read the next chunk.
+         *
+         * @param  vecs Set to the first vector of the chunk, valid until the next call
+         * @return      The number of vectors in the chunk, 0 at the end of the range
+         */
+        unsigned next(const T *&vecs)
         {
-            return &file_db_.getIthVec(key)[0];
+            if (file_db_.isMapped())
+            {
+                return nextMapped(vecs);
+            }
+            if (read_ahead_)
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait(lock, [this]()
+                {
+                    return ready_;
+                });
+                // the last chunk read is empty, the thread is done
+                if (counts_[1 - front_] == 0)
+                {
+                    return 0;
+                }
+                front_ = 1 - front_;
+                pos_ = pending_pos_;
+                ready_ = false;
+                cond_.notify_all();
+            }
+            else
+            {
+                pos_ = next_;
+                counts_[front_] = fill(front_);
+            }
+            vecs = &buffers_[front_][0];
+            return counts_[front_];
+        }
+        /**
+         * Index of the first vector of the chunk returned by the last next().
+         */
+        unsigned position() const
+        {
+            return pos_;
+        }
+    private:
+        FileDB &file_db_;
+        unsigned next_, end_, pos_, chunk_;
+        bool read_ahead_;
+        int open_;
+        std::ifstream in_;
+        std::vector<T> buffers_[2];
+        unsigned counts_[2];
+        /// The buffer handed out by next(), the thread fills the other one
+        unsigned front_;
+        unsigned pending_pos_;
+        std::thread thread_;
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        /// Whether the other buffer holds the next chunk, and whether to stop
+        bool ready_, stop_;
+        /**
+         * Size of the chunk starting at next_, chunks never span two batch files.
+         */
+        unsigned chunkSize() const
+        {
+            if (next_ >= end_)
+            {
+                return 0;
+            }
+            unsigned batch = file_db_.getBatch();
+            return std::min(std::min(chunk_, end_ - next_), batch - next_ % batch);
+        }
+        /**
+         * Hand out the chunk in place and ask the kernel to page in the next one.
+         */
+        unsigned nextMapped(const T *&vecs)
+        {
+            pos_ = next_;
+            unsigned count = chunkSize();
+            vecs = file_db_.mapped(next_);
+            next_ += count;
+            unsigned ahead = chunkSize();
+            if (ahead != 0)
+            {
+                unsigned batch = file_db_.getBatch();
+                file_db_.maps[next_ / batch]->advise(MappedFile::WILLNEED, sizeof(T) * file_db_.getDim() * (next_ % batch), sizeof(T) * file_db_.getDim() * ahead);
+            }
+            return count;
+        }
+        /**
+         * Read the chunk starting at next_ into a buffer.
+         */
+        unsigned fill(unsigned buf)
+        {
+            unsigned count = chunkSize();
+            if (count == 0)
+            {
+                return 0;
+            }
+            unsigned batch = file_db_.getBatch();
+            int ith_db = int(next_ / batch);
+            unsigned ith = next_ % batch;
+            if (ith_db != open_)
+            {
+                in_.close();
+                in_.clear();
+                in_.open(file_db_.getBatchFile(ith_db), std::ios::binary);
+                open_ = ith_db;
+            }
+            in_.seekg(std::streamoff(sizeof(T)) * file_db_.getDim() * ith, std::ios::beg);
+            in_.read((char *)&buffers_[buf][0], std::streamsize(sizeof(T)) * file_db_.getDim() * count);
+            next_ += count;
+            return count;
+        }
+        /**
+         * Body of the read-ahead thread, which fills the buffer not handed
+         * out whenever next() takes the chunk it holds, until the end.
+         */
+        void prefetch()
+        {
+            for (unsigned count = 1; count != 0;)
+            {
+                unsigned back;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    cond_.wait(lock, [this]()
+                    {
+                        return stop_ || !ready_;
+                    });
+                    if (stop_)
+                    {
+                        return;
+                    }
+                    back = 1 - front_;
+                }
+                unsigned pos = next_;
+                count = fill(back);
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    counts_[back] = count;
+                    pending_pos_ = pos;
+                    ready_ = true;
+                }
+                cond_.notify_all();
+            }
         }
     };
 };
@@ -29,11 +29,17 @@
 #pragma once
 #include <map>
 #include <math.h>
+#include <assert.h>
 #include <string>
 #include <vector>
 #include <random>
+#include <algorithm>
 #include <iostream>
 #include <functional>
+#include <mutex>
+#include <memory>
+#include <string.h>
+#include <stdio.h>
 #include <eigen/Eigen/Dense>
 namespace lshbox
 {
@@ -65,8 +71,8 @@ public:
         /// Training iterations
         unsigned I;
     };
-    itqLsh() {}
-    itqLsh(const Parameter &param_)
+    itqLsh(): tolerance(0), fullPca(false), batchRows(0), compressKeys(false), idOnly(false), packed(false), extraBits(0), bucketMax(0) {}
+    itqLsh(const Parameter &param_): tolerance(0), fullPca(false), batchRows(0), compressKeys(false), idOnly(false), packed(false), extraBits(0), bucketMax(0)
     {
         reset(param_);
     }
@@ -81,20 +87,44 @@ public:
     /**
      * Train the data to get several groups of suitable vector for index.
      *
-     * @param data A instance of Matrix<DATATYPE>, most of the time, is the search library.
+     * Every table draws its samples from its own generator seeded with (seed,
+     * table id), so the result only depends on the seed, not on the number of
+     * threads.
+     *
+     * @param data    A instance of Matrix<DATATYPE>, most of the time, is the search library.
+     * @param threads Number of threads, the tables are trained concurrently and
+     *                the threads left over are given to Eigen for the ITQ products.
+     * @param seed    Seed of the random generators, 0 means seeded with the time.
      */
     template<typename DATA>
-    void train(DATA &data);
+    void train(DATA &data, unsigned threads = 1, unsigned seed = 0);
+    /**
+     * Hash every vector of the data into the tables, the keys of the vectors
+     * follow those already in the index.
+     *
+     * The vectors are projected block by block with the fused projection
+     * matrix, so each block costs a single matrix product for all the tables.
+     * The range of an INT8 encoding, see setPayload(), is fitted to the first
+     * vectors hashed, unless it was kept by clear().
+     *
+     * @param data    A instance of Matrix<DATATYPE> or FileDB<DATATYPE>.
+     * @param threads Number of threads, the dataset is split into one contiguous
+     *                range per thread and the results are merged in order.
+     */
     template<typename DATA>
-    void hash(DATA &data);
-    std::string getHashVal(unsigned table_id, DATATYPE *domin);
+    void hash(DATA &data, unsigned threads = 1);
+    HashCode getHashVal(unsigned table_id, const DATATYPE *domin);
+    /**
+     * Get the hash values of a vector in all the tables.
+     */
+    std::vector<HashCode> getHashVals(const DATATYPE *domin);
     /**
      * Insert a vector to the index.
      *
      * @param key   The sequence number of vector
      * @param domin The pointer to the vector
      */
-    void insert(unsigned key, DATATYPE *domin);
+    void insert(unsigned key, const DATATYPE *domin);
     /**
      * Query the approximate nearest neighborholds.
      *
@@ -102,21 +132,30 @@ public:
      * @param scanner Top-K scanner, use for scan the approximate nearest neighborholds
      */
     template<typename SCANNER>
-    void query(DATATYPE *domin, SCANNER &scanner, unsigned hamming = 0);
+    void query(const DATATYPE *domin, SCANNER &scanner, unsigned hamming = 0);
     /**
      * Save the index as binary file.
      *
+     * The file starts with the magic "ITQPARAM" and PARAM_VERSION, followed
+     * by the parameters with the extra bits and the buckets with their codes
+     * as packed words, see HashCode::write(). Files of the original format,
+     * without the header, hold the codes as '0'/'1' strings and are rejected
+     * by load().
+     *
      * @param file The path of binary file.
+     * @return     False if the file can not be written
      */
-    void save(const std::string &file);
+    bool save(const std::string &file);
     /**
      * Load the index from binary file.
      *
      * @param file The path of binary file.
+     * @return     False if the file is missing, truncated, or of a version or
+     *             code width this build does not support
      */
-    void load(const std::string &file);
+    bool load(const std::string &file);
     // --------------------------------------------------------------------------------
-    void saveHashPos(const std::string &file)
+    bool saveHashPos(const std::string &file)
     {
         std::ofstream out(file, std::ios::binary);
         out.write((char *)&hashedSize, sizeof(unsigned));
@@ -124,27 +163,36 @@ public:
         out.write((char *)&fitSplitBits, sizeof(unsigned));
         for (unsigned i = 0; i != param.L; ++i)
         {
-            unsigned total = unsigned(hashPos[i].size());
+            const BucketTable &table = tables[i];
+            unsigned total = table.size();
             out.write((char *)&total, sizeof(unsigned));
-            for (auto iter = hashPos[i].begin(); iter != hashPos[i].end(); ++iter)
+            for (unsigned b = 0; b != table.size(); ++b)
             {
-                out.write(&iter->first[0], param.N);
-                out.write(&iter->second.first[0], fitSplitBits);
-                out.write((char *)&iter->second.second, sizeof(unsigned));
+                unsigned file = table.file(b);
+                unsigned pos = table.position(b);
+                table.code(b).write(out, codeBits());
+                out.write((char *)&file, sizeof(unsigned));
+                out.write((char *)&pos, sizeof(unsigned));
             }
-            total = unsigned(fileSize[i].size());
+            total = unsigned(fileSize[i].size() - std::count(fileSize[i].begin(), fileSize[i].end(), 0u));
             out.write((char *)&total, sizeof(unsigned));
-            for (auto iter = fileSize[i].begin(); iter != fileSize[i].end(); ++iter)
+            for (unsigned file = 0; file != fileSize[i].size(); ++file)
             {
-                out.write(&iter->first[0], fitSplitBits);
-                out.write((char *)&iter->second, sizeof(unsigned));
+                if (fileSize[i][file] != 0)
+                {
+                    out.write((char *)&file, sizeof(unsigned));
+                    out.write((char *)&fileSize[i][file], sizeof(unsigned));
+                }
             }
         }
         out.close();
+        return !out.fail();
     }
+    /**
+     * Load the bucket file positions, after the tables are loaded by load().
+     */
     void loadHashPos(const std::string &file)
     {
-        hashPos.resize(param.L);
         fileSize.resize(param.L);
         std::ifstream in(file, std::ios::binary);
         in.read((char *)&hashedSize, sizeof(unsigned));
@@ -152,375 +200,1986 @@ public:
         in.read((char *)&fitSplitBits, sizeof(unsigned));
         for (unsigned i = 0; i != param.L; ++i)
         {
+            fileSize[i].assign(size_t(1) << fitSplitBits, 0);
             unsigned total;
             in.read((char *)&total, sizeof(unsigned));
             for (unsigned j = 0; j != total; ++j)
             {
-                std::string hashVal(param.N, ' ');
-                in.read(&hashVal[0], param.N);
-                std::string file(fitSplitBits, ' ');
-                in.read(&file[0], fitSplitBits);
+                HashCode hashVal;
+                hashVal.read(in, codeBits());
+                unsigned file;
+                in.read((char *)&file, sizeof(unsigned));
                 unsigned pos;
                 in.read((char *)&pos, sizeof(unsigned));
-                hashPos[i][hashVal] = std::make_pair(file, pos);
+                int bucket = tables[i].find(hashVal);
+                if (bucket >= 0)
+                {
+                    tables[i].locate(bucket, file, pos);
+                }
             }
             in.read((char *)&total, sizeof(unsigned));
             for (unsigned j = 0; j != total; ++j)
             {
-                std::string file(fitSplitBits, ' ');
-                in.read(&file[0], fitSplitBits);
+                unsigned file;
+                in.read((char *)&file, sizeof(unsigned));
                 unsigned size;
                 in.read((char *)&size, sizeof(unsigned));
                 fileSize[i][file] = size;
             }
         }
         in.close();
+        detectIdOnly();
     }
+    /**
+     * Write the vectors of every bucket to the bucket files.
+     *
+     * The layout of every table is computed first, then the data is read in
+     * one sequential pass that scatters every vector into a partition per
+     * bucket file of every table, all of them within LAYOUT_MB megabytes. A
+     * partition that fits its share is filled in place and written once. A
+     * larger one is the append buffer of its file in a WriterPool, written
+     * whenever it is full, and the file is read back and put in bucket order
+     * after the pass. The files are synced once, when they are all written.
+     *
+     * Every table has its own files and writers, so the tables are laid out,
+     * scattered and reordered concurrently. hash.param, hash.file.pos and
+     * hash.index are saved last, see saveFiles(). With setIdOnly() only the
+     * first table has bucket files, the vectors are encoded as set by
+     * setPayload(), and with setPacked() every bucket file is a region of the
+     * packed file of its table, written in place at its extent.
+     *
+     * @param path       The directory to save the index in
+     * @param data       The hashed data
+     * @param single_max The size of each bucket file in MB
+     * @param threads    Number of tables written at once
+     * @return           False if a file can not be written
+     */
     template<typename DATA>
-    void tablesToFiles(const std::string &path, DATA &data, unsigned single_max = 100)
+    bool tablesToFiles(const std::string &path, DATA &data, unsigned single_max = 100, unsigned threads = 1)
     {
+        typedef typename DATA::Reader Reader;
         singleMax = single_max;
-        double each_mb_vecs = 1024.0 * 1024 / sizeof(DATATYPE) / param.D;
-        fitSplitBits = std::min(unsigned(std::ceil(log(hashedSize / each_mb_vecs / singleMax)/log(2.0))), param.N);
+        size_t rowBytes = payload.rowBytes<DATATYPE>();
+        double each_mb_vecs = 1024.0 * 1024 / rowBytes;
+        double files = std::max(hashedSize / each_mb_vecs / singleMax, 1.0);
+        fitSplitBits = std::min(unsigned(std::ceil(log(files) / log(2.0))), std::min(param.N, 31u));
 
+        freeze();
         std::string tables_path = path + "/" + getHashSavePath();
         _mkdir(tables_path.c_str());
-        hashPos.resize(param.L);
         fileSize.resize(param.L);
-        for (unsigned i = 0; i != param.L; ++i)
+        packOffsets.assign(param.L, std::vector<uint64_t>());
+        unsigned fileCount = 1u << fitSplitBits;
+        // the tables with bucket files
+        unsigned stored = idOnly ? 1 : param.L;
+        // the file of every key and its position inside that file, by table
+        std::vector<std::vector<unsigned> > keyFile(stored), keyPos(stored);
+        parallel_for(param.L, threads, [&](unsigned i, unsigned)
         {
-            std::string ith_table_path = tables_path + "/L_" + std::to_string(long double(i));
-
-            _mkdir(ith_table_path.c_str());
-            std::map<std::string, std::vector<unsigned> > &table = tables[i];
-            for (auto iter = table.begin(); iter != table.end(); ++iter)
-            {
-                std::string hashVal = iter->first;
-                std::cout << "table: " << i << ", " << hashVal << std::endl;
-                std::string file = hashVal.substr(0, fitSplitBits);
-                if (fileSize[i].find(file) == fileSize[i].end())
+            std::vector<unsigned> buffer;
+            BucketTable &table = tables[i];
+            std::vector<unsigned> &sizes = fileSize[i];
+            sizes.assign(fileCount, 0);
+            if (i >= stored)
+            {
+                for (unsigned b = 0; b != table.size(); ++b)
+                {
+                    table.locate(b, unsigned(table.code(b).prefix(fitSplitBits)), 0);
+                }
+                return;
+            }
+            if (!packed)
+            {
+                _mkdir(getTablePath(tables_path, i).c_str());
+            }
+            keyFile[i].resize(hashedSize);
+            keyPos[i].resize(hashedSize);
+            for (unsigned b = 0; b != table.size(); ++b)
+            {
+                unsigned file = unsigned(table.code(b).prefix(fitSplitBits));
+                unsigned &size = sizes[file];
+                table.locate(b, file, size);
+                const unsigned *keys = table.decode(b, buffer);
+                for (unsigned j = 0; j != table.length(b); ++j)
+                {
+                    keyFile[i][keys[j]] = file;
+                    keyPos[i][keys[j]] = size++;
+                }
+            }
+        });
+        // rows of every partition, a partition of more rows spills to its file
+        size_t partRows = std::max<size_t>(size_t(LAYOUT_MB) * 1024 * 1024 / rowBytes / stored / fileCount, 1);
+        std::vector<std::vector<std::vector<char> > > parts(stored, std::vector<std::vector<char> >(fileCount));
+        // the writer of table i writes its files in order, ids[i][file] is the
+        // id of a bucket file, or of its region of the packed file
+        std::vector<std::shared_ptr<WriterPool> > writers(stored);
+        std::vector<std::vector<unsigned> > ids(stored, std::vector<unsigned>(fileCount));
+        for (unsigned i = 0; i != stored; ++i)
+        {
+            writers[i].reset(new WriterPool(std::max(1u, WRITER_FILES / stored), partRows * rowBytes));
+            unsigned pack = 0;
+            if (packed)
+            {
+                PackedFile::extents(fileSize[i], rowBytes, packOffsets[i]);
+                pack = writers[i]->add(getPackPath(tables_path, i) + ".tmp");
+            }
+            for (unsigned file = 0; file != fileCount; ++file)
+            {
+                if (packed)
+                {
+                    ids[i][file] = writers[i]->region(pack, size_t(packOffsets[i][file]));
+                }
+                else
+                {
+                    ids[i][file] = writers[i]->add(getTablePath(tables_path, i) + "/" + getFileName(file) + ".hash");
+                }
+                if (fileSize[i][file] <= partRows)
+                {
+                    parts[i][file].resize(size_t(fileSize[i][file]) * rowBytes);
+                }
+            }
+        }
+        std::cout << "---------- write tables ----------" << std::endl;
+        progress_display pd(hashedSize);
+        Reader reader(data, 0, hashedSize, 0, true);
+        const DATATYPE *vecs;
+        for (unsigned rows = reader.next(vecs); rows != 0; rows = reader.next(vecs))
+        {
+            unsigned begin = reader.position();
+            parallel_for(stored, threads, [&](unsigned i, unsigned)
+            {
+                std::vector<char> row(rowBytes);
+                for (unsigned j = 0; j != rows; ++j)
+                {
+                    unsigned file = keyFile[i][begin + j];
+                    const DATATYPE *vec = vecs + size_t(j) * param.D;
+                    if (fileSize[i][file] <= partRows)
+                    {
+                        encodeRow(reader, j, vec, &parts[i][file][size_t(keyPos[i][begin + j]) * rowBytes]);
+                    }
+                    else
+                    {
+                        encodeRow(reader, j, vec, row.data());
+                        writers[i]->append(ids[i][file], row.data(), rowBytes);
+                    }
+                }
+            });
+            pd += rows;
+        }
+        // whether the files of every table are written
+        std::vector<char> written(stored);
+        parallel_for(stored, threads, [&](unsigned i, unsigned)
+        {
+            WriterPool &writer = *writers[i];
+            std::vector<char> ordered;
+            std::vector<unsigned> &sizes = fileSize[i];
+            // positions of the spilled rows of every file, in the order they were written
+            std::vector<unsigned> start(fileCount + 1, 0), order;
+            for (unsigned file = 0; file != fileCount; ++file)
+            {
+                start[file + 1] = start[file] + (sizes[file] > partRows ? sizes[file] : 0);
+            }
+            order.resize(start[fileCount]);
+            for (unsigned key = 0; key != hashedSize && !order.empty(); ++key)
+            {
+                unsigned file = keyFile[i][key];
+                if (sizes[file] > partRows)
+                {
+                    order[start[file]++] = keyPos[i][key];
+                }
+            }
+            for (unsigned file = 0; file != fileCount; ++file)
+            {
+                std::vector<char> &part = parts[i][file];
+                if (sizes[file] == 0)
+                {
+                    continue;
+                }
+                if (sizes[file] <= partRows)
                 {
-                    fileSize[i][file] = 0;
+                    writer.write(ids[i][file], 0, part.data(), part.size());
+                    std::vector<char>().swap(part);
+                    continue;
                 }
-                hashPos[i][hashVal] = std::make_pair(file, fileSize[i][file]);
-                std::ofstream out(ith_table_path + "/" + file + ".hash", std::ios::binary | std::ios::app);
-                std::vector<unsigned> &keys = iter->second;
-                for (auto it = keys.begin(); it != keys.end(); ++it)
+                // start[file] is now the end of the rows of file in order
+                const unsigned *dest = &order[start[file] - sizes[file]];
+                std::vector<char> rows(size_t(sizes[file]) * rowBytes);
+                writer.read(ids[i][file], 0, rows.data(), rows.size());
+                ordered.resize(rows.size());
+                for (unsigned j = 0; j != sizes[file]; ++j)
                 {
-                    out.write((char *)&data.getIthVec(*it)[0], sizeof(DATATYPE) * param.D);
+                    memcpy(&ordered[size_t(dest[j]) * rowBytes], &rows[size_t(j) * rowBytes], rowBytes);
                 }
-                out.close();
-                fileSize[i][file] += unsigned(keys.size());
+                writer.write(ids[i][file], 0, ordered.data(), ordered.size());
             }
+            written[i] = writer.close();
+        });
+        if (std::count(written.begin(), written.end(), 0) != 0)
+        {
+            std::cout << "write error: " << tables_path << std::endl;
+            return false;
         }
-        save(tables_path + "/hash.param");
-        saveHashPos(tables_path + "/hash.file.pos");
+        return saveFiles(tables_path);
     }
+    /**
+     * Add the vectors of data to an index saved by tablesToFiles() and loaded
+     * by loadHashedFile(), without training it again.
+     *
+     * The vectors are hashed with the stored projections and get the keys
+     * following those of the index. A bucket file holding a bucket that
+     * receives new vectors is written again under a .tmp name, with every
+     * bucket in order followed by its new vectors, so it holds no stale rows
+     * and its size in getFileSize() is the number of its live vectors. The
+     * other bucket files are not touched, and only the first table has bucket
+     * files if the index is ID-only, see setIdOnly(). hash.param,
+     * hash.file.pos and hash.index are then saved again and the rewritten
+     * files renamed, see saveFiles().
+     *
+     * In a packed index, see setPacked(), a changed bucket file is written in
+     * a new extent after the used part of the packed file instead, the other
+     * extents are not touched. Once more than DEAD_PERCENT of the packed file
+     * is left unused, its live extents are copied in order to a new packed
+     * file, L_<k>.pack.tmp, which saveFiles() renames.
+     *
+     * @param path    The directory of the index
+     * @param data    The new vectors
+     * @param threads Number of threads used to hash the vectors
+     * @return        False if a file can not be read or written, the index
+     *                on disk is then left as it was, except for unused
+     *                extents after the used part of its packed files
+     */
+    template<typename DATA>
+    bool appendToFiles(const std::string &path, DATA &data, unsigned threads = 1);
     template<typename FILESCANNER>
-    void fileQuery(DATATYPE *domin, FILESCANNER &fileScanner, unsigned hamming = 0)
+    void fileQuery(const DATATYPE *domin, FILESCANNER &fileScanner, unsigned hamming = 0)
     {
+        fileScanner.setTombstones(tombstones.empty() ? NULL : &tombstones);
+        fileScanner.setPayload(&payload);
         fileScanner.reset(domin);
+        std::vector<HashCode> codes = getHashVals(domin);
         for (unsigned k = 0; k != param.L; ++k)
         {
-            std::string hashVal = getHashVal(k, domin);
+            HashCode &hashVal = codes[k];
             fileScanner.insert(k, hashVal);
             if (hamming > 0)
             {
-                hamming_in_k hammK(hashVal, hamming);
-                std::vector<std::string> &hashVals = hammK.generateHashVals();
+                hamming_in_k hammK(hashVal, param.N, hamming);
+                std::vector<HashCode> hashVals = hammK.generateHashVals();
                 for (auto iter = hashVals.begin(); iter != hashVals.end(); ++iter)
                 {
                     fileScanner.insert(k, *iter);
                 }
             }
         }
-        fileScanner.topk().genTopk();
+        fileScanner.genTopk();
     }
     std::string getHashSavePath()
     {
-        return std::string("ITQ_L-") + std::to_string(long double(param.L)) + "_N-" + std::to_string(long double(param.N)) + "_S-" + std::to_string(long double(param.S)) + "_I-" + std::to_string(long double(param.I));
+        std::string path = std::string("ITQ_L-") + std::to_string(long double(param.L)) + "_N-" + std::to_string(long double(param.N)) + "_S-" + std::to_string(long double(param.S)) + "_I-" + std::to_string(long double(param.I));
+        if (extraBits != 0)
+        {
+            path += "_E-" + std::to_string(long double(extraBits));
+        }
+        return path;
     }
-    void loadHashedFile(const std::string &path)
+    /**
+     * Name of the bucket file which holds the given code prefix.
+     */
+    std::string getFileName(unsigned file)
     {
-        load(path + "/" + "hash.param");
-        loadHashPos(path + "/" + "hash.file.pos");
+        return bitsToString(file, fitSplitBits);
     }
-    std::vector<std::map<std::string, std::vector<unsigned> > > &getTables()
+    /**
+     * Load an index saved by tablesToFiles(), mapped from hash.index if it is
+     * usable, else parsed from hash.param and hash.file.pos, with the keys
+     * deleted in hash.deleted and the encoding of its vectors in hash.payload.
+     * The index is packed if the first table has a packed file, the offsets
+     * of its bucket files are then read from hash.pack.
+     *
+     * @return False if neither hash.index nor hash.param can be read
+     */
+    bool loadHashedFile(const std::string &path)
     {
-        return tables;
+        tombstones.load(path + "/" + "hash.deleted");
+        if (!mapIndex(path + "/" + "hash.index"))
+        {
+            if (!load(path + "/" + "hash.param"))
+            {
+                return false;
+            }
+            loadHashPos(path + "/" + "hash.file.pos");
+        }
+        payload.load(path + "/" + "hash.payload", param.D);
+        struct stat st;
+        packed = stat(getPackPath(path, 0).c_str(), &st) == 0;
+        packOffsets.clear();
+        if (packed && (!PackedFile::loadExtents(path + "/" + "hash.pack", packOffsets) || packOffsets.size() != param.L))
+        {
+            layoutPacks();
+        }
+        return true;
     }
-    std::vector<std::map<std::string, std::pair<std::string, unsigned> > > &getHashPos()
+    /**
+     * Drop the hashed vectors with their buckets and deleted keys, keeping the
+     * trained projections and the encoding of the vectors, so that another
+     * dataset can be hashed from key 0 and encoded as the dropped one,
+     * within the same INT8 range. setPayload() fits the range again.
+     */
+    void clear()
     {
-        return hashPos;
+        indexFile.reset();
+        tables.assign(param.L, BucketTable());
+        pending.assign(param.L, std::map<HashCode, std::vector<unsigned> >());
+        fileSize.clear();
+        packOffsets.clear();
+        tombstones.clear();
+        hashedSize = 0;
     }
-    std::vector<std::map<std::string, unsigned> > &getFileSize()
+    /**
+     * Delete the vector of key from the index. Its key stays in the buckets
+     * and its vector in the bucket files, but queries no longer return it.
+     *
+     * @return False if the key was already deleted
+     */
+    bool remove(unsigned key)
     {
-        return fileSize;
+        return tombstones.erase(key);
     }
-    unsigned &getHashedSize()
+    const Tombstones &getTombstones() const
     {
-        return hashedSize;
+        return tombstones;
     }
-    unsigned &getSingleMax()
+    /**
+     * Save the deleted keys of an index saved by tablesToFiles() in its
+     * hash.deleted, which loadHashedFile() reads back. The file is written
+     * under a temporary name and renamed over the previous one.
+     *
+     * @return False if the file can not be written or renamed
+     */
+    bool saveTombstones(const std::string &path)
     {
-        return singleMax;
+        std::string file = path + "/" + "hash.deleted";
+        if (!tombstones.save(file + ".tmp") || !replaceFile(file + ".tmp", file))
+        {
+            std::cout << "save error: " << file << std::endl;
+            ::remove((file + ".tmp").c_str());
+            return false;
+        }
+        return true;
     }
-private:
-    Parameter param;
-    std::vector<std::vector<std::vector<float> > > pcsAll;
-    std::vector<std::vector<std::vector<float> > > omegasAll;
-    std::vector<std::map<std::string, std::vector<unsigned> > > tables;
-    unsigned hashedSize, singleMax, fitSplitBits;
-    std::vector<std::map<std::string, std::pair<std::string, unsigned> > > hashPos;
-    std::vector<std::map<std::string, unsigned> > fileSize;
-};
-}
-// ------------------------- implementation -------------------------
-template<typename DATATYPE>
-void lshbox::itqLsh<DATATYPE>::reset(const Parameter &param_)
-{
-    param = param_;
-    hashedSize = 0;
-    tables.resize(param.L);
-    pcsAll.resize(param.L);
-    omegasAll.resize(param.L);
-}
-template<typename DATATYPE>
-template<typename DATA>
-void lshbox::itqLsh<DATATYPE>::train(DATA &data)
-{
-    int npca = param.N;
-    std::mt19937 rng(unsigned(std::time(0)));
-    std::normal_distribution<float> nd;
-    std::uniform_int_distribution<unsigned> usBits(0, data.getSize() - 1);
-    for (unsigned k = 0; k != param.L; ++k)
+    /**
+     * Save hash.param, hash.file.pos and hash.index in the directory path of
+     * an index once its bucket files are written, and hash.payload if the
+     * vectors are encoded, and hash.pack if the index is packed.
+     *
+     * They are written under temporary names first, and nothing is renamed
+     * unless all of them, with the packed files and the bucket files written
+     * again by appendToFiles(), are complete; the temporary files are removed
+     * otherwise. Every file is then replaced by one rename, so it is always
+     * either the old or the new file, the bucket files first and hash.index
+     * last. The files are not replaced together: a crash while they are
+     * renamed can leave an index whose files are partly of the old save.
+     *
+     * @return False if a file can not be written or renamed
+     */
+    bool saveFiles(const std::string &path)
     {
-        std::cout << "---------- train table " << k << " ----------" << std::endl;
-        std::cout << "generate train dataset ..." << std::endl;
-        std::vector<unsigned> seqs;
-        while (seqs.size() != param.S)
+        const char *names[] = {"hash.param", "hash.file.pos", "hash.payload", "hash.pack", "hash.index"};
+        bool written[] = {true, true, payload.reduced(), packed, true};
+        bool ok = save(path + "/" + names[0] + ".tmp");
+        ok = saveHashPos(path + "/" + names[1] + ".tmp") && ok;
+        if (written[2])
         {
-            unsigned target = usBits(rng);
-            if (std::find(seqs.begin(), seqs.end(), target) == seqs.end())
-            {
-                seqs.push_back(target);
-            }
+            ok = payload.save(path + "/" + names[2] + ".tmp") && ok;
         }
-        std::sort(seqs.begin(), seqs.end());
-        Eigen::MatrixXf tmp(param.S, data.getDim());
-        progress_display pd1(unsigned(tmp.rows()));
-        for (unsigned i = 0; i != tmp.rows(); ++i)
+        if (written[3])
         {
-            std::vector<float> vals(0);
-            for (int j = 0; j != data.getDim(); ++j)
-            {
-                vals.push_back(data[seqs[i]][j]);
-            }
-            tmp.row(i) = Eigen::Map<Eigen::VectorXf>(&vals[0], data.getDim());
-            ++pd1;
+            ok = PackedFile::saveExtents(path + "/" + names[3] + ".tmp", packOffsets) && ok;
         }
-        std::cout << "pca ..." << std::endl;
-        Eigen::MatrixXf centered = tmp.rowwise() - tmp.colwise().mean();
-        Eigen::MatrixXf cov = (centered.transpose() * centered) / float(tmp.rows() - 1);
-        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> eig(cov);
-        Eigen::MatrixXf mat_pca = eig.eigenvectors().rightCols(npca);
-        Eigen::MatrixXf mat_c = tmp * mat_pca;
-        Eigen::MatrixXf R(npca, npca);
-        for (unsigned i = 0; i != R.rows(); ++i)
+        ok = saveIndex(path + "/" + names[4] + ".tmp") && ok;
+        // the files to replace, those the others refer to first
+        std::vector<std::string> files;
+        files.swap(staged);
+        for (unsigned k = 0; k != param.L && packed; ++k)
         {
-            for (unsigned j = 0; j != R.cols(); ++j)
+            struct stat st;
+            if (stat((getPackPath(path, k) + ".tmp").c_str(), &st) == 0)
             {
-                R(i, j) = nd(rng);
+                files.push_back(getPackPath(path, k));
             }
         }
-        Eigen::JacobiSVD<Eigen::MatrixXf> svd(R, Eigen::ComputeThinU | Eigen::ComputeThinV);
-        R = svd.matrixU();
-        std::cout << "itq ..." << std::endl;
-        progress_display pd2(param.I);
-        for (unsigned iter = 0; iter != param.I; ++iter)
+        for (unsigned i = 0; i != 5; ++i)
         {
-            Eigen::MatrixXf Z = mat_c * R;
-            Eigen::MatrixXf UX(Z.rows(), Z.cols());
-            for (unsigned i = 0; i != Z.rows(); ++i)
+            if (written[i])
             {
-                for (unsigned j = 0; j != Z.cols(); ++j)
-                {
-                    if (Z(i, j) > 0)
-                    {
-                        UX(i, j) = 1;
-                    }
-                    else
-                    {
-                        UX(i, j) = -1;
-                    }
-                }
+                files.push_back(path + "/" + names[i]);
             }
-            Eigen::JacobiSVD<Eigen::MatrixXf> svd_tmp(UX.transpose() * mat_c, Eigen::ComputeThinU | Eigen::ComputeThinV);
-            R = svd_tmp.matrixV() * svd_tmp.matrixU().transpose();
-            ++pd2;
         }
-        std::cout << "save the parameters ..." << std::endl;
-        omegasAll[k].resize(npca);
-        for (unsigned i = 0; i != omegasAll[k].size(); ++i)
+        if (!ok)
         {
-            omegasAll[k][i].resize(npca);
-            for (unsigned j = 0; j != omegasAll[k][i].size(); ++j)
+            std::cout << "save error: " << path << std::endl;
+            for (unsigned i = 0; i != files.size(); ++i)
             {
-                omegasAll[k][i][j] = R(j, i);
+                ::remove((files[i] + ".tmp").c_str());
             }
+            return false;
         }
-        pcsAll[k].resize(npca);
-        for (unsigned i = 0; i != pcsAll[k].size(); ++i)
+        for (unsigned i = 0; i != files.size(); ++i)
         {
-            pcsAll[k][i].resize(param.D);
-            for (unsigned j = 0; j != pcsAll[k][i].size(); ++j)
+            if (!replaceFile(files[i] + ".tmp", files[i]))
             {
-                pcsAll[k][i][j] = mat_pca(j, i);
+                std::cout << "rename error: " << files[i] << std::endl;
+                return false;
             }
         }
-    }
-}
-template<typename DATATYPE>
-template<typename DATA>
-void lshbox::itqLsh<DATATYPE>::hash(DATA &data)
-{
-    std::cout << "---------- hash ----------" << std::endl;
-    progress_display pd(data.getSize());
-    for (unsigned i = 0; i != data.getSize(); ++i)
-    {
-        insert(i, data[i]);
-        ++pd;
-    }
-}
-template<typename DATATYPE>
-std::string lshbox::itqLsh<DATATYPE>::getHashVal(unsigned table_id, DATATYPE *domin)
-{
-    std::vector<float> domin_pc(pcsAll[table_id].size());
-    for (unsigned i = 0; i != domin_pc.size(); ++i)
-    {
-        for (unsigned j = 0; j != pcsAll[table_id][i].size(); ++j)
+        // the files of an encoding or packing the index no longer has
+        for (unsigned i = 2; i != 4; ++i)
         {
-            domin_pc[i] += domin[j] * pcsAll[table_id][i][j];
+            std::string file = path + "/" + names[i];
+            struct stat st;
+            if (!written[i] && stat(file.c_str(), &st) == 0 && ::remove(file.c_str()) != 0)
+            {
+                std::cout << "remove error: " << file << std::endl;
+                return false;
+            }
         }
+        return true;
     }
-    std::string hashVal = "";
-    for (unsigned i = 0; i != domin_pc.size(); ++i)
+    /**
+     * The directory of the bucket files of table k in the directory path of
+     * an unpacked index.
+     */
+    std::string getTablePath(const std::string &path, unsigned k)
     {
-        float product = 0;
-        for (unsigned j = 0; j != omegasAll[table_id][i].size(); ++j)
-        {
-            product += float(domin_pc[j] * omegasAll[table_id][i][j]);
-        }
-        hashVal += product > 0 ? "1" : "0";
+        return path + "/L_" + std::to_string(long double(k));
     }
-    return hashVal;
-}
-template<typename DATATYPE>
-void lshbox::itqLsh<DATATYPE>::insert(unsigned key, DATATYPE *domin)
-{
-    for (unsigned k = 0; k != param.L; ++k)
+    /**
+     * The packed file of table k in the directory path of an index.
+     */
+    std::string getPackPath(const std::string &path, unsigned k)
     {
-        std::string hashVal = getHashVal(k, domin);
-        tables[k][hashVal].push_back(key);
+        return path + "/L_" + std::to_string(long double(k)) + ".pack";
     }
-    hashedSize += 1;
-}
-template<typename DATATYPE>
-template<typename SCANNER>
-void lshbox::itqLsh<DATATYPE>::query(DATATYPE *domin, SCANNER &scanner, unsigned hamming = 0)
-{
-    scanner.reset(domin);
-    for (unsigned k = 0; k != param.L; ++k)
+    /**
+     * Read the vectors of a bucket file of table k in the directory path of
+     * the index, from its packed file if the index is packed.
+     *
+     * @return False if the file is missing or shorter than its vectors
+     */
+    bool readBucketFile(const std::string &path, unsigned k, unsigned file, std::vector<char> &rows)
     {
-        std::string hashVal = getHashVal(k, domin);
-        if (tables[k].find(hashVal) != tables[k].end())
+        size_t rowBytes = payload.rowBytes<DATATYPE>();
+        rows.resize(fileSize[k][file] * rowBytes);
+        if (packed)
         {
-            std::vector<unsigned> &idxs = tables[k][hashVal];
-            for (auto iter = idxs.begin(); iter != idxs.end(); ++iter)
+            PackedFile pack;
+            if (!pack.open(getPackPath(path, k)))
             {
-                scanner(*iter);
+                std::cout << "open error: " << getPackPath(path, k) << std::endl;
+                return false;
             }
+            return pack.read(packOffsets[k][file], rows.data(), rows.size());
         }
-        if (hamming > 0)
+        return readUnpacked(path, k, file, rows);
+    }
+    /**
+     * The vectors stored in the bucket files of saved indexes, read back as
+     * one dataset like FileDB, the keys of an index following those of the
+     * index added before it.
+     *
+     * The bucket files of the first table of every index are mapped and each
+     * vector is found by its file and position, so the vectors are never all
+     * in memory. hash() takes the buckets of the keys from their indexes,
+     * and tablesToFiles() copies the stored rows as they are into an index
+     * with the same encoding, see Payload::equals(), instead of quantizing
+     * them again.
+     */
+    class Stored
+    {
+    public:
+        Stored(): dim_(0) {}
+        /**
+         * Add the vectors of lsh, loaded from the directory path.
+         *
+         * @return False if a bucket file of the first table can not be
+         *         mapped, nothing is then added
+         */
+        bool add(itqLsh &lsh, const std::string &path)
         {
-            hamming_in_k hammK(hashVal, hamming);
-            std::vector<std::string> &hashVals = hammK.generateHashVals();
-            for (auto it = hashVals.begin(); it != hashVals.end(); ++it)
+            Source source;
+            source.lsh = &lsh;
+            source.first = getSize();
+            source.payload = lsh.getPayload();
+            dim_ = lsh.getParam().D;
+            size_t rowBytes = source.payload.template rowBytes<DATATYPE>();
+            const BucketTable &table = lsh.getTables()[0];
+            const std::vector<unsigned> &sizes = lsh.getFileSize()[0];
+            // the start of every bucket file in the mapped files
+            std::vector<const char *> starts(sizes.size(), NULL);
+            for (unsigned file = 0; file != sizes.size(); ++file)
             {
-                if (tables[k].find(*it) != tables[k].end())
+                if (sizes[file] == 0)
+                {
+                    continue;
+                }
+                if (!lsh.packed || source.mapped.empty())
                 {
-                    std::vector<unsigned> &idxss = tables[k][*it];
-                    for (auto iter = idxss.begin(); iter != idxss.end(); ++iter)
+                    std::string name = lsh.packed ? lsh.getPackPath(path, 0) : lsh.getTablePath(path, 0) + "/" + lsh.getFileName(file) + ".hash";
+                    std::shared_ptr<MappedFile> mapped(new MappedFile);
+                    if (!mapped->open(name))
                     {
-                        scanner(*iter);
+                        std::cout << "map error: " << name << std::endl;
+                        return false;
                     }
+                    mapped->advise(MappedFile::RANDOM);
+                    source.mapped.push_back(mapped);
                 }
+                starts[file] = source.mapped.back()->data() + (lsh.packed ? lsh.packOffsets[0][file] : 0);
             }
+            rows_.resize(source.first + lsh.getHashedSize(), NULL);
+            std::vector<unsigned> buffer;
+            for (unsigned b = 0; b != table.size(); ++b)
+            {
+                const unsigned *keys = table.decode(b, buffer);
+                const char *row = starts[table.file(b)] + size_t(table.position(b)) * rowBytes;
+                for (unsigned i = 0; i != table.length(b); ++i)
+                {
+                    rows_[source.first + keys[i]] = row + i * rowBytes;
+                }
+            }
+            sources_.push_back(source);
+            return true;
         }
-    }
-    scanner.topk().genTopk();
-}
-template<typename DATATYPE>
-void lshbox::itqLsh<DATATYPE>::save(const std::string &file)
-{
-    std::ofstream out(file, std::ios::binary);
-    out.write((char *)&param.L, sizeof(unsigned));
-    out.write((char *)&param.D, sizeof(unsigned));
-    out.write((char *)&param.N, sizeof(unsigned));
-    out.write((char *)&param.S, sizeof(unsigned));
-    for (unsigned i = 0; i != param.L; ++i)
-    {
-        unsigned count = unsigned(tables[i].size());
-        out.write((char *)&count, sizeof(unsigned));
-        for (auto iter = tables[i].begin(); iter != tables[i].end(); ++iter)
+        unsigned getDim() const
         {
-            std::string target = iter->first;
-            out.write(&target[0], param.N);
-            unsigned length = unsigned(iter->second.size());
-            out.write((char *)&length, sizeof(unsigned));
-            out.write((char *) & ((iter->second)[0]), sizeof(unsigned) * length);
+            return dim_;
         }
-        for (unsigned j = 0; j != param.N; ++j)
+        unsigned getSize() const
         {
-            out.write((char *)&pcsAll[i][j][0], sizeof(float) * param.D);
-            out.write((char *)&omegasAll[i][j][0], sizeof(float) * param.N);
+            return unsigned(rows_.size());
         }
-    }
-    out.close();
-}
-template<typename DATATYPE>
-void lshbox::itqLsh<DATATYPE>::load(const std::string &file)
-{
-    std::ifstream in(file, std::ios::binary);
-    in.read((char *)&param.L, sizeof(unsigned));
-    in.read((char *)&param.D, sizeof(unsigned));
-    in.read((char *)&param.N, sizeof(unsigned));
-    in.read((char *)&param.S, sizeof(unsigned));
-    tables.resize(param.L);
-    pcsAll.resize(param.L);
-    omegasAll.resize(param.L);
-    for (unsigned i = 0; i != param.L; ++i)
-    {
-        unsigned count;
-        in.read((char *)&count, sizeof(unsigned));
-        for (unsigned j = 0; j != count; ++j)
+        /**
+         * The stored row of key, encoded by payload(key).
+         */
+        const char *row(unsigned key) const
         {
-            std::string target(param.N, ' ');
-            in.read(&target[0], param.N);
-            unsigned length;
-            in.read((char *)&length, sizeof(unsigned));
-            tables[i][target].resize(length);
-            in.read((char *) & (tables[i][target][0]), sizeof(unsigned) * length);
+            return rows_[key];
         }
-        pcsAll[i].resize(param.N);
-        omegasAll[i].resize(param.N);
-        for (unsigned j = 0; j != param.N; ++j)
+        const Payload &payload(unsigned key) const
         {
-            pcsAll[i][j].resize(param.D);
-            omegasAll[i][j].resize(param.N);
-            in.read((char *)&pcsAll[i][j][0], sizeof(float) * param.D);
-            in.read((char *)&omegasAll[i][j][0], sizeof(float) * param.N);
+            unsigned i = unsigned(sources_.size() - 1);
+            while (sources_[i].first > key)
+            {
+                --i;
+            }
+            return sources_[i].payload;
+        }
+        /**
+         * Sequential reader over a range of vectors, same interface as
+         * FileDB<T>::Reader, the last argument is ignored.
+         */
+        class Reader
+        {
+        public:
+            Reader(const Stored &stored, unsigned begin, unsigned end, unsigned chunk = 0, bool = false)
+                : stored_(stored), next_(begin), end_(end), pos_(begin), chunk_(chunk ? chunk : 4096) {}
+            unsigned next(const DATATYPE *&vecs)
+            {
+                pos_ = next_;
+                unsigned count = std::min(chunk_, end_ - next_);
+                buffer_.resize(size_t(count) * stored_.getDim());
+                for (unsigned i = 0; i != count; ++i)
+                {
+                    stored_.payload(pos_ + i).decode(stored_.row(pos_ + i), &buffer_[size_t(i) * stored_.getDim()]);
+                }
+                vecs = buffer_.data();
+                next_ += count;
+                return count;
+            }
+            unsigned position() const
+            {
+                return pos_;
+            }
+            /**
+             * The stored row of vector i of the last chunk.
+             */
+            const char *row(unsigned i) const
+            {
+                return stored_.row(pos_ + i);
+            }
+            const Payload &payload(unsigned i) const
+            {
+                return stored_.payload(pos_ + i);
+            }
+        private:
+            const Stored &stored_;
+            unsigned next_, end_, pos_, chunk_;
+            std::vector<DATATYPE> buffer_;
+        };
+    private:
+        struct Source
+        {
+            const itqLsh *lsh;
+            /// Key of the first vector of the index
+            unsigned first;
+            Payload payload;
+            std::vector<std::shared_ptr<MappedFile> > mapped;
+        };
+        unsigned dim_;
+        std::vector<Source> sources_;
+        /// The stored row of every key
+        std::vector<const char *> rows_;
+        friend class itqLsh;
+    };
+    /**
+     * Add the stored vectors to the tables without hashing them again. The
+     * indexes share the projections of this one, so every key keeps the
+     * buckets it has in its own index, the codes of rows decoded from a
+     * reduced encoding could differ from those of the original vectors.
+     */
+    void hash(Stored &stored, unsigned threads = 1)
+    {
+        std::cout << "---------- hash ----------" << std::endl;
+        if (hashedSize == 0 && !payload.fitted(param.D) && stored.getSize() != 0)
+        {
+            payload = stored.payload(0);
         }
+        thaw();
+        parallel_for(param.L, threads, [&](unsigned k, unsigned)
+        {
+            std::vector<unsigned> buffer;
+            for (unsigned i = 0; i != stored.sources_.size(); ++i)
+            {
+                const BucketTable &table = stored.sources_[i].lsh->tables[k];
+                unsigned first = hashedSize + stored.sources_[i].first;
+                for (unsigned b = 0; b != table.size(); ++b)
+                {
+                    const unsigned *keys = table.decode(b, buffer);
+                    std::vector<unsigned> &bucket = pending[k][table.code(b)];
+                    for (unsigned j = 0; j != table.length(b); ++j)
+                    {
+                        bucket.push_back(first + keys[j]);
+                    }
+                }
+            }
+            seal(k);
+        });
+        hashedSize += stored.getSize();
+    }
+    /**
+     * Save the whole index, with the positions of the buckets in the bucket
+     * files, in a single file that mapIndex() uses in place.
+     *
+     * The file starts with an IndexHeader, then holds for every table its PCA
+     * basis and ITQ rotation, its BucketTable and the sizes of its bucket files,
+     * every array aligned to INDEX_ALIGN bytes. Numbers are in the byte order
+     * of the host, recorded in the header.
+     *
+     * @return False if the file can not be written
+     */
+    bool saveIndex(const std::string &file);
+    /**
+     * Map an index saved by saveIndex(). The bucket arrays are used in place,
+     * so loading costs no parsing, and processes mapping the same file share
+     * one copy of it in the page cache.
+     *
+     * @return False if the file is missing, or was saved with another version,
+     *         byte order or code width
+     */
+    bool mapIndex(const std::string &file);
+    std::vector<BucketTable> &getTables()
+    {
+        freeze();
+        return tables;
+    }
+    /**
+     * Move the buckets filled by hash() and insert() into the compact tables
+     * searched by queries. hash() and load() leave the index frozen and
+     * query() freezes it after inserts.
+     */
+    void freeze()
+    {
+        for (unsigned k = 0; k != pending.size(); ++k)
+        {
+            if (!pending[k].empty())
+            {
+                seal(k);
+            }
+        }
+    }
+    /**
+     * Number of vectors in every bucket file of every table.
+     */
+    std::vector<std::vector<unsigned> > &getFileSize()
+    {
+        return fileSize;
+    }
+    const Parameter &getParam() const
+    {
+        return param;
+    }
+    unsigned &getHashedSize()
+    {
+        return hashedSize;
+    }
+    unsigned &getSingleMax()
+    {
+        return singleMax;
+    }
+    unsigned &getFitSplitBits()
+    {
+        return fitSplitBits;
+    }
+    /**
+     * Stop the ITQ iterations of a table once the quantization loss improves
+     * by less than tol relative to the previous iteration. 0 runs all param.I
+     * iterations.
+     */
+    void setTolerance(float tol)
+    {
+        tolerance = tol;
+    }
+    /**
+     * Compute the PCA basis from the covariance of the whole dataset, gathered
+     * in one sequential pass, instead of from the S training samples. All the
+     * tables then share the basis and differ by their ITQ rotation.
+     */
+    void setFullPca(bool full)
+    {
+        fullPca = full;
+    }
+    /**
+     * Learn the ITQ rotation from the training samples read in blocks of rows
+     * vectors at every iteration, instead of holding all of them in memory, so
+     * param.S is bounded by the disk rather than the memory. 0 keeps the
+     * samples in memory.
+     */
+    void setBatchRows(unsigned rows)
+    {
+        batchRows = rows;
+    }
+    /**
+     * Keep the keys of the buckets compressed, see BucketTable::compress(),
+     * which cuts the memory of the tables and the size of hash.index. Queries
+     * decode the keys of every bucket they probe.
+     */
+    void setCompressKeys(bool compress)
+    {
+        compressKeys = compress;
+    }
+    /**
+     * Write the vectors to the bucket files of the first table only, so they
+     * are stored once, in the order of its buckets. The other tables only
+     * keep the keys of their buckets, which queries find in the files of the
+     * first table. An index whose other tables have no bucket files is loaded
+     * as such.
+     */
+    void setIdOnly(bool only)
+    {
+        idOnly = only;
+    }
+    bool getIdOnly() const
+    {
+        return idOnly;
+    }
+    /**
+     * Pack the bucket files of every table into one file, L_<k>.pack in the
+     * directory of the index, where every bucket file is an extent aligned to
+     * PackedFile::ALIGN bytes, at the offsets saved in hash.pack.
+     * FilesScanner then reads the buckets through one open descriptor per
+     * table instead of opening a file per bucket file it loads. An index with
+     * packed files is loaded as such.
+     */
+    void setPacked(bool pack)
+    {
+        packed = pack;
+    }
+    bool getPacked() const
+    {
+        return packed;
+    }
+    /**
+     * Store the vectors of the bucket files as float16 or int8 instead of
+     * DATATYPE, see Payload. The range of int8 is fitted when the first
+     * vectors are hashed, and saved in hash.payload. Queries then rank the
+     * candidates by approximate distances, which FilesScanner::setRerank()
+     * corrects with the exact vectors.
+     */
+    void setPayload(Payload::Type type)
+    {
+        payload.reset(type, param.D);
+    }
+    const Payload &getPayload() const
+    {
+        return payload;
+    }
+    /**
+     * Extend the codes with bits extra bits, the signs of the principal
+     * components that follow the N used by ITQ, taken around their training
+     * mean, and split the buckets holding more than max keys by the extended
+     * codes. A query then scans only the sub-bucket of its own extended code
+     * in a split bucket, which bounds the candidates on skewed data. It must
+     * be set before train(), and N + bits must not exceed D.
+     */
+    void setSplitBuckets(unsigned bits, unsigned max)
+    {
+        extraBits = bits;
+        bucketMax = max;
+    }
+    /**
+     * Number of bits of the codes in the tables, N plus the extra bits.
+     */
+    unsigned codeBits() const
+    {
+        return param.N + extraBits;
+    }
+    /**
+     * Quantization loss ||B - VR||^2 of every ITQ iteration run by train(), per table.
+     */
+    const std::vector<std::vector<float> > &getLosses() const
+    {
+        return losses;
+    }
+private:
+    /// Number of vectors projected together by hash()
+    static const unsigned HASH_BLOCK = 4096;
+    /// Percent of a packed file left unused by appendToFiles() past which it is compacted
+    static const unsigned DEAD_PERCENT = 50;
+    /// Memory used by tablesToFiles() to assemble the bucket files, in MB
+    static const unsigned LAYOUT_MB = 512;
+    /// Bucket files open at once while they are written
+    static const unsigned WRITER_FILES = 256;
+    /// Append buffer of every bucket file written by appendToFiles(), in MB
+    static const unsigned APPEND_MB = 4;
+    /// Version of the hash.index format
+    static const uint32_t INDEX_VERSION = 4;
+    /// Version of the hash.param format, see save()
+    static const uint32_t PARAM_VERSION = 1;
+    struct IndexHeader
+    {
+        char magic[8];
+        uint32_t version;
+        /// 0x01020304 in the byte order of the writer
+        uint32_t order;
+        /// HashCode::WORDS of the writer
+        uint32_t words;
+        uint32_t L, D, N, S, I;
+        uint32_t hashedSize, singleMax, fitSplitBits;
+        uint32_t extraBits, bucketMax;
+    };
+    /// The mapped index file the tables refer to, if any
+    std::shared_ptr<MappedFile> indexFile;
+    /// Keys deleted by remove(), skipped by the scanners
+    Tombstones tombstones;
+    /// Encoding of the vectors in the bucket files
+    Payload payload;
+    /// Bucket files written under a .tmp name, renamed by saveFiles()
+    std::vector<std::string> staged;
+    /// Offset of every bucket file in the packed file of its table, followed
+    /// by the end of the used part of that file, if the index is packed
+    std::vector<std::vector<uint64_t> > packOffsets;
+    Parameter param;
+    float tolerance;
+    bool fullPca;
+    unsigned batchRows;
+    bool compressKeys;
+    bool idOnly;
+    bool packed;
+    unsigned extraBits;
+    unsigned bucketMax;
+    std::vector<std::vector<float> > losses;
+    std::vector<std::vector<std::vector<float> > > pcsAll;
+    std::vector<std::vector<std::vector<float> > > omegasAll;
+    /// Principal components of the extra bits of every table, and their thresholds
+    std::vector<std::vector<std::vector<float> > > extraPcsAll;
+    std::vector<std::vector<float> > extraMeansAll;
+    /// PCA basis and ITQ rotation of all the tables, followed by the
+    /// components of the extra bits, folded into one D x (L * codeBits()) matrix
+    Eigen::MatrixXf projection;
+    /// Threshold of every column of projection, 0 except for the extra bits
+    Eigen::RowVectorXf thresholds;
+    void fuseProjections();
+    /**
+     * Move the frozen tables back into pending before they are updated.
+     */
+    void thaw()
+    {
+        for (unsigned k = 0; k != tables.size(); ++k)
+        {
+            if (!tables[k].empty())
+            {
+                tables[k].extract(pending[k]);
+            }
+        }
+    }
+    /**
+     * Pass the keys of the buckets probed by code in table k to scanner.
+     */
+    template<typename SCANNER>
+    void scanBuckets(unsigned k, const HashCode &code, SCANNER &scanner, std::vector<unsigned> &buffer)
+    {
+        unsigned first, last;
+        if (!tables[k].probe(code, first, last))
+        {
+            return;
+        }
+        for (unsigned b = first; b != last; ++b)
+        {
+            const unsigned *keys = tables[k].decode(b, buffer);
+            for (unsigned i = 0; i != tables[k].length(b); ++i)
+            {
+                scanner(keys[i]);
+            }
+        }
+    }
+    /**
+     * Set idOnly if the tables after the first have no bucket files.
+     */
+    void detectIdOnly()
+    {
+        idOnly = param.L > 1 && hashedSize != 0
+                 && size_t(std::count(fileSize[1].begin(), fileSize[1].end(), 0u)) == fileSize[1].size();
+    }
+    /**
+     * Encode vector j of the last chunk of reader, vec, into row.
+     */
+    template<typename READER>
+    void encodeRow(const READER &, unsigned, const DATATYPE *vec, char *row) const
+    {
+        payload.encode(vec, row);
+    }
+    /**
+     * Copy stored vector j of the last chunk of reader into row as it is, if
+     * it has the encoding of this index.
+     */
+    void encodeRow(const typename Stored::Reader &reader, unsigned j, const DATATYPE *vec, char *row) const
+    {
+        if (reader.payload(j).equals(payload))
+        {
+            memcpy(row, reader.row(j), payload.rowBytes<DATATYPE>());
+        }
+        else
+        {
+            payload.encode(vec, row);
+        }
+    }
+    /**
+     * Copy the live extents of the packed file of table k, open as pack in
+     * writer, in order to L_<k>.pack.tmp in the directory path of the index
+     * if more than DEAD_PERCENT of it is unused, saveFiles() renames it.
+     */
+    void compactPack(const std::string &path, unsigned k, WriterPool &writer, unsigned pack)
+    {
+        size_t rowBytes = payload.rowBytes<DATATYPE>();
+        std::vector<uint64_t> offsets;
+        PackedFile::extents(fileSize[k], rowBytes, offsets);
+        uint64_t used = packOffsets[k].back();
+        if ((used - offsets.back()) * 100 <= used * DEAD_PERCENT)
+        {
+            return;
+        }
+        unsigned id = writer.add(getPackPath(path, k) + ".tmp");
+        std::vector<char> rows;
+        for (unsigned file = 0; file != fileSize[k].size(); ++file)
+        {
+            if (fileSize[k][file] != 0)
+            {
+                rows.resize(size_t(fileSize[k][file]) * rowBytes);
+                writer.read(pack, size_t(packOffsets[k][file]), rows.data(), rows.size());
+                writer.write(id, size_t(offsets[file]), rows.data(), rows.size());
+            }
+        }
+        packOffsets[k].swap(offsets);
+    }
+    /**
+     * Offsets of the bucket files in the packed files of an index without
+     * hash.pack, laid out by extents().
+     */
+    void layoutPacks()
+    {
+        packOffsets.assign(param.L, std::vector<uint64_t>());
+        for (unsigned k = 0; k != param.L; ++k)
+        {
+            if (size_t(std::count(fileSize[k].begin(), fileSize[k].end(), 0u)) != fileSize[k].size())
+            {
+                PackedFile::extents(fileSize[k], payload.rowBytes<DATATYPE>(), packOffsets[k]);
+            }
+        }
+    }
+    /**
+     * Read the vectors of a bucket file of table k from its own file.
+     *
+     * @return False if the file can not be opened or is too short
+     */
+    bool readUnpacked(const std::string &path, unsigned k, unsigned file, std::vector<char> &rows)
+    {
+        rows.resize(size_t(fileSize[k][file]) * payload.rowBytes<DATATYPE>());
+        if (rows.empty())
+        {
+            return true;
+        }
+        std::string name = getTablePath(path, k) + "/" + getFileName(file) + ".hash";
+        std::ifstream in(name, std::ios::binary);
+        if (!in.read(rows.data(), rows.size()))
+        {
+            std::cout << "read error: " << name << std::endl;
+            return false;
+        }
+        return true;
+    }
+    /**
+     * Build table k from its pending buckets.
+     */
+    void seal(unsigned k)
+    {
+        tables[k].assign(pending[k], param.N);
+        tables[k].setSplitMax(bucketMax);
+        if (compressKeys)
+        {
+            tables[k].compress();
+        }
+    }
+    /**
+     * PCA and ITQ rotation of table k from its training samples, pca is the
+     * shared PCA basis with the components of the extra bits first, or empty
+     * to compute it from the samples.
+     */
+    void trainTable(unsigned k, const Eigen::MatrixXf &tmp, const Eigen::MatrixXf &pca, std::mt19937 &rng, bool verbose);
+    /**
+     * Same as trainTable() with the samples seqs read again in blocks of
+     * batchRows at every pass, lock guards the reads.
+     */
+    template<typename DATA>
+    void trainTableBatched(unsigned k, DATA &data, const std::vector<unsigned> &seqs,
+                           const Eigen::MatrixXf &pca, std::mt19937 &rng, std::mutex &lock, bool verbose);
+    /**
+     * Random orthogonal N x N matrix, the initial ITQ rotation.
+     */
+    Eigen::MatrixXf randomRotation(std::mt19937 &rng);
+    /**
+     * Record the quantization loss of an iteration of table k, true once it
+     * improves by no more than the tolerance.
+     */
+    bool converged(unsigned k, float loss);
+    /**
+     * Store the PCA basis and ITQ rotation of table k, and the components of
+     * its extra bits with the mean of the samples.
+     */
+    void setTable(unsigned k, const Eigen::MatrixXf &mat_pca, const Eigen::MatrixXf &R,
+                  const Eigen::MatrixXf &extra, const Eigen::RowVectorXf &mean);
+    /**
+     * Covariance matrix of the whole dataset, accumulated block by block on
+     * contiguous ranges read by separate threads.
+     */
+    template<typename DATA>
+    Eigen::MatrixXf covariance(DATA &data, unsigned threads);
+    /**
+     * Code of table k from the projections vals of a vector on its columns of projection.
+     */
+    HashCode signToCode(const float *vals, unsigned k) const
+    {
+        HashCode hashVal;
+        for (unsigned i = 0; i != param.N; ++i)
+        {
+            if (vals[i] > 0)
+            {
+                hashVal.set(i);
+            }
+        }
+        const float *limits = thresholds.data() + k * codeBits();
+        for (unsigned i = param.N; i != codeBits(); ++i)
+        {
+            if (vals[i] > limits[i])
+            {
+                hashVal.set(i);
+            }
+        }
+        return hashVal;
+    }
+    std::vector<BucketTable> tables;
+    /// Buckets filled by hash() and insert(), moved into tables by freeze()
+    std::vector<std::map<HashCode, std::vector<unsigned> > > pending;
+    unsigned hashedSize, singleMax, fitSplitBits;
+    std::vector<std::vector<unsigned> > fileSize;
+};
+}
+// ------------------------- implementation -------------------------
+// Eigen takes the sizes of a matrix by reference, which needs a definition
+template<typename DATATYPE>
+const unsigned lshbox::itqLsh<DATATYPE>::HASH_BLOCK;
+template<typename DATATYPE>
+void lshbox::itqLsh<DATATYPE>::reset(const Parameter &param_)
+{
+    param = param_;
+    assert(param.N <= HashCode::MAX_BITS);
+    hashedSize = 0;
+    tables.resize(param.L);
+    pending.resize(param.L);
+    pcsAll.resize(param.L);
+    omegasAll.resize(param.L);
+    extraPcsAll.resize(param.L);
+    extraMeansAll.resize(param.L);
+}
+template<typename DATATYPE>
+template<typename DATA>
+void lshbox::itqLsh<DATATYPE>::train(DATA &data, unsigned threads, unsigned seed)
+{
+    typedef Eigen::Matrix<DATATYPE, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrix;
+    if (seed == 0)
+    {
+        seed = unsigned(std::time(0));
+    }
+    unsigned workers = std::max(1u, std::min(threads, param.L));
+    int eigenThreads = Eigen::nbThreads();
+    if (threads > 1)
+    {
+        Eigen::initParallel();
+        Eigen::setNbThreads(int(std::max(1u, threads / workers)));
+    }
+    assert(codeBits() <= HashCode::MAX_BITS && codeBits() <= param.D);
+    Eigen::MatrixXf pca;
+    if (fullPca)
+    {
+        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> eig(covariance(data, threads));
+        pca = eig.eigenvectors().rightCols(codeBits());
+    }
+    losses.resize(param.L);
+    std::mutex lock;
+    parallel_for(param.L, workers, [&](unsigned k, unsigned)
+    {
+        std::seed_seq seeds{seed, k};
+        std::mt19937 rng(seeds);
+        std::vector<unsigned> seqs = sampleDistinct(param.S, data.getSize(), rng);
+        if (batchRows != 0)
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                std::cout << "---------- train table " << k << " ----------" << std::endl;
+            }
+            trainTableBatched(k, data, seqs, pca, rng, lock, workers == 1);
+        }
+        else
+        {
+            std::vector<DATATYPE> rows(seqs.size() * data.getDim());
+            {
+                // the samples are read one table at a time, FileDB streams are not shared safely
+                std::lock_guard<std::mutex> guard(lock);
+                std::cout << "---------- train table " << k << " ----------" << std::endl;
+                std::cout << "generate train dataset ..." << std::endl;
+                data.getRows(&seqs[0], unsigned(seqs.size()), &rows[0]);
+            }
+            Eigen::MatrixXf tmp = Eigen::Map<RowMatrix>(&rows[0], seqs.size(), data.getDim()).template cast<float>();
+            std::vector<DATATYPE>().swap(rows);
+            trainTable(k, tmp, pca, rng, workers == 1);
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        std::cout << "table " << k << " trained in " << losses[k].size() << " iterations";
+        if (!losses[k].empty())
+        {
+            std::cout << ", quantization loss " << losses[k].front() << " -> " << losses[k].back();
+        }
+        std::cout << std::endl;
+    });
+    if (threads > 1)
+    {
+        Eigen::setNbThreads(eigenThreads);
+    }
+    fuseProjections();
+}
+template<typename DATATYPE>
+void lshbox::itqLsh<DATATYPE>::trainTable(unsigned k, const Eigen::MatrixXf &tmp, const Eigen::MatrixXf &pca, std::mt19937 &rng, bool verbose)
+{
+    int npca = param.N;
+    // concurrent tables keep quiet instead of interleaving their progress bars
+    std::ostream silent(0);
+    std::ostream &os = verbose ? std::cout : silent;
+    Eigen::MatrixXf basis = pca;
+    if (basis.size() == 0)
+    {
+        os << "pca ..." << std::endl;
+        Eigen::MatrixXf centered = tmp.rowwise() - tmp.colwise().mean();
+        Eigen::MatrixXf cov = (centered.transpose() * centered) / float(tmp.rows() - 1);
+        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> eig(cov);
+        basis = eig.eigenvectors().rightCols(codeBits());
+    }
+    Eigen::MatrixXf mat_pca = basis.rightCols(npca);
+    Eigen::MatrixXf mat_c = tmp * mat_pca;
+    Eigen::MatrixXf R = randomRotation(rng);
+    os << "itq ..." << std::endl;
+    progress_display pd2(param.I, os);
+    losses[k].clear();
+    for (unsigned iter = 0; iter != param.I; ++iter)
+    {
+        Eigen::MatrixXf Z = mat_c * R;
+        Eigen::MatrixXf UX(Z.rows(), Z.cols());
+        for (unsigned i = 0; i != Z.rows(); ++i)
+        {
+            for (unsigned j = 0; j != Z.cols(); ++j)
+            {
+                if (Z(i, j) > 0)
+                {
+                    UX(i, j) = 1;
+                }
+                else
+                {
+                    UX(i, j) = -1;
+                }
+            }
+        }
+        if (converged(k, (UX - Z).squaredNorm()))
+        {
+            break;
+        }
+        Eigen::JacobiSVD<Eigen::MatrixXf> svd_tmp(UX.transpose() * mat_c, Eigen::ComputeThinU | Eigen::ComputeThinV);
+        R = svd_tmp.matrixV() * svd_tmp.matrixU().transpose();
+        ++pd2;
+    }
+    pd2 += param.I - pd2.count();
+    os << "save the parameters ..." << std::endl;
+    setTable(k, mat_pca, R, basis.leftCols(extraBits), tmp.colwise().mean());
+}
+template<typename DATATYPE>
+template<typename DATA>
+void lshbox::itqLsh<DATATYPE>::trainTableBatched(unsigned k, DATA &data, const std::vector<unsigned> &seqs,
+        const Eigen::MatrixXf &pca, std::mt19937 &rng, std::mutex &lock, bool verbose)
+{
+    typedef Eigen::Matrix<DATATYPE, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrix;
+    std::ostream silent(0);
+    std::ostream &os = verbose ? std::cout : silent;
+    unsigned total = unsigned(seqs.size());
+    std::vector<DATATYPE> rows(size_t(std::min(batchRows, total)) * param.D);
+    Eigen::MatrixXf block;
+    // read the samples from seqs[begin] into block
+    auto read = [&](unsigned begin)
+    {
+        unsigned count = std::min(batchRows, total - begin);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            data.getRows(&seqs[begin], count, &rows[0]);
+        }
+        block = Eigen::Map<RowMatrix>(&rows[0], count, param.D).template cast<float>();
+    };
+    Eigen::MatrixXf basis = pca;
+    Eigen::VectorXd sum = Eigen::VectorXd::Zero(param.D);
+    if (basis.size() == 0)
+    {
+        os << "pca ..." << std::endl;
+        Eigen::MatrixXd scatter = Eigen::MatrixXd::Zero(param.D, param.D);
+        for (unsigned begin = 0; begin < total; begin += batchRows)
+        {
+            read(begin);
+            scatter += (block.transpose() * block).template cast<double>();
+            sum += block.colwise().sum().transpose().template cast<double>();
+        }
+        Eigen::VectorXd mean = sum / double(total);
+        Eigen::MatrixXd cov = (scatter - double(total) * mean * mean.transpose()) / double(std::max(1u, total - 1));
+        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> eig(cov.cast<float>());
+        basis = eig.eigenvectors().rightCols(codeBits());
+    }
+    else if (extraBits != 0)
+    {
+        // the extra bits are split at the mean of the samples
+        for (unsigned begin = 0; begin < total; begin += batchRows)
+        {
+            read(begin);
+            sum += block.colwise().sum().transpose().template cast<double>();
+        }
+    }
+    Eigen::MatrixXf mat_pca = basis.rightCols(param.N);
+    Eigen::MatrixXf R = randomRotation(rng);
+    os << "itq ..." << std::endl;
+    progress_display pd(param.I, os);
+    losses[k].clear();
+    for (unsigned iter = 0; iter != param.I; ++iter)
+    {
+        // B^T * V and the loss summed over the blocks equal those of the whole sample
+        Eigen::MatrixXf BV = Eigen::MatrixXf::Zero(param.N, param.N);
+        double loss = 0;
+        for (unsigned begin = 0; begin < total; begin += batchRows)
+        {
+            read(begin);
+            Eigen::MatrixXf V = block * mat_pca;
+            Eigen::MatrixXf Z = V * R;
+            Eigen::MatrixXf UX = (Z.array() > 0).select(Eigen::MatrixXf::Ones(Z.rows(), Z.cols()), -1);
+            loss += (UX - Z).squaredNorm();
+            BV.noalias() += UX.transpose() * V;
+        }
+        if (converged(k, float(loss)))
+        {
+            break;
+        }
+        Eigen::JacobiSVD<Eigen::MatrixXf> svd(BV, Eigen::ComputeThinU | Eigen::ComputeThinV);
+        R = svd.matrixV() * svd.matrixU().transpose();
+        ++pd;
+    }
+    pd += param.I - pd.count();
+    os << "save the parameters ..." << std::endl;
+    setTable(k, mat_pca, R, basis.leftCols(extraBits), (sum / double(std::max(1u, total))).transpose().template cast<float>());
+}
+template<typename DATATYPE>
+Eigen::MatrixXf lshbox::itqLsh<DATATYPE>::randomRotation(std::mt19937 &rng)
+{
+    std::normal_distribution<float> nd;
+    Eigen::MatrixXf R(param.N, param.N);
+    for (unsigned i = 0; i != R.rows(); ++i)
+    {
+        for (unsigned j = 0; j != R.cols(); ++j)
+        {
+            R(i, j) = nd(rng);
+        }
+    }
+    Eigen::JacobiSVD<Eigen::MatrixXf> svd(R, Eigen::ComputeThinU | Eigen::ComputeThinV);
+    return svd.matrixU();
+}
+template<typename DATATYPE>
+bool lshbox::itqLsh<DATATYPE>::converged(unsigned k, float loss)
+{
+    losses[k].push_back(loss);
+    size_t iter = losses[k].size() - 1;
+    return tolerance > 0 && iter != 0 && losses[k][iter - 1] - loss <= tolerance * losses[k][iter - 1];
+}
+template<typename DATATYPE>
+void lshbox::itqLsh<DATATYPE>::setTable(unsigned k, const Eigen::MatrixXf &mat_pca, const Eigen::MatrixXf &R,
+        const Eigen::MatrixXf &extra, const Eigen::RowVectorXf &mean)
+{
+    unsigned npca = param.N;
+    omegasAll[k].resize(npca);
+    for (unsigned i = 0; i != omegasAll[k].size(); ++i)
+    {
+        omegasAll[k][i].resize(npca);
+        for (unsigned j = 0; j != omegasAll[k][i].size(); ++j)
+        {
+            omegasAll[k][i][j] = R(j, i);
+        }
+    }
+    pcsAll[k].resize(npca);
+    for (unsigned i = 0; i != pcsAll[k].size(); ++i)
+    {
+        pcsAll[k][i].resize(param.D);
+        for (unsigned j = 0; j != pcsAll[k][i].size(); ++j)
+        {
+            pcsAll[k][i][j] = mat_pca(j, i);
+        }
+    }
+    extraPcsAll[k].resize(extraBits);
+    extraMeansAll[k].resize(extraBits);
+    for (unsigned i = 0; i != extraBits; ++i)
+    {
+        extraPcsAll[k][i].resize(param.D);
+        for (unsigned j = 0; j != param.D; ++j)
+        {
+            extraPcsAll[k][i][j] = extra(j, i);
+        }
+        extraMeansAll[k][i] = mean.dot(extra.col(i));
+    }
+}
+template<typename DATATYPE>
+template<typename DATA>
+Eigen::MatrixXf lshbox::itqLsh<DATATYPE>::covariance(DATA &data, unsigned threads)
+{
+    typedef Eigen::Matrix<DATATYPE, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrix;
+    std::cout << "---------- pca over the dataset ----------" << std::endl;
+    unsigned size = unsigned(data.getSize());
+    unsigned blocks = (size + HASH_BLOCK - 1) / HASH_BLOCK;
+    unsigned parts = std::max(1u, std::min(threads, blocks));
+    // the block products are in float, the sums over blocks in double
+    std::vector<Eigen::MatrixXd> scatters(parts, Eigen::MatrixXd::Zero(param.D, param.D));
+    std::vector<Eigen::VectorXd> sums(parts, Eigen::VectorXd::Zero(param.D));
+    std::mutex mtx;
+    Eigen::initParallel();
+    progress_display pd(size);
+    parallel_for(parts, parts, [&](unsigned part, unsigned)
+    {
+        Eigen::MatrixXf block(HASH_BLOCK, param.D);
+        Eigen::MatrixXf scatter(param.D, param.D);
+        unsigned end = std::min(size, blocks * (part + 1) / parts * HASH_BLOCK);
+        typename DATA::Reader reader(data, blocks * part / parts * HASH_BLOCK, end, HASH_BLOCK, true);
+        const DATATYPE *vecs;
+        for (unsigned rows = reader.next(vecs); rows != 0; rows = reader.next(vecs))
+        {
+            block.topRows(rows) = Eigen::Map<const RowMatrix>(vecs, rows, param.D).template cast<float>();
+            scatter.setZero();
+            scatter.template selfadjointView<Eigen::Lower>().rankUpdate(block.topRows(rows).transpose());
+            scatters[part] += scatter.template cast<double>();
+            sums[part] += block.topRows(rows).colwise().sum().transpose().template cast<double>();
+            std::lock_guard<std::mutex> lock(mtx);
+            pd += rows;
+        }
+    });
+    for (unsigned part = 1; part != parts; ++part)
+    {
+        scatters[0] += scatters[part];
+        sums[0] += sums[part];
+    }
+    Eigen::VectorXd mean = sums[0] / double(size);
+    Eigen::MatrixXd cov = scatters[0].template selfadjointView<Eigen::Lower>();
+    cov = (cov - double(size) * mean * mean.transpose()) / double(std::max(1u, size - 1));
+    return cov.template cast<float>();
+}
+template<typename DATATYPE>
+void lshbox::itqLsh<DATATYPE>::fuseProjections()
+{
+    projection.resize(param.D, param.L * codeBits());
+    thresholds = Eigen::RowVectorXf::Zero(param.L * codeBits());
+    for (unsigned k = 0; k != param.L; ++k)
+    {
+        Eigen::MatrixXf pcs(param.D, param.N);
+        Eigen::MatrixXf omegas(param.N, param.N);
+        for (unsigned i = 0; i != param.N; ++i)
+        {
+            for (unsigned j = 0; j != param.D; ++j)
+            {
+                pcs(j, i) = pcsAll[k][i][j];
+            }
+            for (unsigned j = 0; j != param.N; ++j)
+            {
+                omegas(j, i) = omegasAll[k][i][j];
+            }
+        }
+        projection.middleCols(k * codeBits(), param.N) = pcs * omegas;
+        for (unsigned i = 0; i != extraBits; ++i)
+        {
+            for (unsigned j = 0; j != param.D; ++j)
+            {
+                projection(j, k * codeBits() + param.N + i) = extraPcsAll[k][i][j];
+            }
+            thresholds(k * codeBits() + param.N + i) = extraMeansAll[k][i];
+        }
+    }
+}
+template<typename DATATYPE>
+template<typename DATA>
+void lshbox::itqLsh<DATATYPE>::hash(DATA &data, unsigned threads)
+{
+    typedef Eigen::Matrix<DATATYPE, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrix;
+    typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrixXf;
+    std::cout << "---------- hash ----------" << std::endl;
+    unsigned size = unsigned(data.getSize());
+    unsigned first = hashedSize;
+    unsigned blocks = (size + HASH_BLOCK - 1) / HASH_BLOCK;
+    unsigned parts = std::max(1u, std::min(threads, blocks));
+    // each part hashes a contiguous range of blocks into its own tables
+    std::vector<std::vector<std::map<HashCode, std::vector<unsigned> > > > partTables(parts);
+    // the encoding is fitted to the first vectors, those added later are clamped to it
+    bool fit = first == 0 && !payload.fitted(param.D);
+    if (fit)
+    {
+        payload.reset(payload.type(), param.D);
+    }
+    std::vector<Payload> ranges(fit ? parts : 0, payload);
+    thaw();
+    std::mutex mtx;
+    Eigen::initParallel();
+    progress_display pd(size);
+    parallel_for(parts, parts, [&](unsigned part, unsigned)
+    {
+        std::vector<std::map<HashCode, std::vector<unsigned> > > &local = partTables[part];
+        local.resize(param.L);
+        RowMatrixXf projected(HASH_BLOCK, param.L * codeBits());
+        unsigned end = std::min(size, blocks * (part + 1) / parts * HASH_BLOCK);
+        typename DATA::Reader reader(data, blocks * part / parts * HASH_BLOCK, end, HASH_BLOCK, true);
+        const DATATYPE *vecs;
+        for (unsigned rows = reader.next(vecs); rows != 0; rows = reader.next(vecs))
+        {
+            unsigned begin = reader.position();
+            if (!ranges.empty())
+            {
+                ranges[part].fit(vecs, rows);
+            }
+            projected.topRows(rows).noalias() = Eigen::Map<const RowMatrix>(vecs, rows, param.D).template cast<float>() * projection;
+            for (unsigned i = 0; i != rows; ++i)
+            {
+                const float *vals = projected.row(i).data();
+                for (unsigned k = 0; k != param.L; ++k)
+                {
+                    local[k][signToCode(vals + k * codeBits(), k)].push_back(first + begin + i);
+                }
+            }
+            std::lock_guard<std::mutex> lock(mtx);
+            pd += rows;
+        }
+    });
+    // merge the parts in order, so the keys of each bucket stay ascending
+    parallel_for(param.L, threads, [&](unsigned k, unsigned)
+    {
+        for (unsigned part = 0; part != parts; ++part)
+        {
+            std::map<HashCode, std::vector<unsigned> > &local = partTables[part][k];
+            for (auto iter = local.begin(); iter != local.end(); ++iter)
+            {
+                std::vector<unsigned> &keys = pending[k][iter->first];
+                if (keys.empty())
+                {
+                    keys.swap(iter->second);
+                }
+                else
+                {
+                    keys.insert(keys.end(), iter->second.begin(), iter->second.end());
+                }
+            }
+            local.clear();
+        }
+        seal(k);
+    });
+    for (unsigned part = 0; part != ranges.size(); ++part)
+    {
+        payload.fit(ranges[part]);
+    }
+    if (!ranges.empty())
+    {
+        payload.seal();
+    }
+    hashedSize += size;
+}
+template<typename DATATYPE>
+template<typename DATA>
+bool lshbox::itqLsh<DATATYPE>::appendToFiles(const std::string &path, DATA &data, unsigned threads)
+{
+    assert(data.getDim() == param.D);
+    unsigned first = hashedSize;
+    freeze();
+    // the position and length of every bucket in the bucket files
+    std::vector<std::map<HashCode, std::pair<unsigned, unsigned> > > before(param.L);
+    for (unsigned k = 0; k != (idOnly ? 1 : param.L); ++k)
+    {
+        for (unsigned b = 0; b != tables[k].size(); ++b)
+        {
+            before[k][tables[k].code(b)] = std::make_pair(tables[k].position(b), tables[k].length(b));
+        }
+    }
+    hash(data, threads);
+    // the tables are rebuilt, hash.index can be written again
+    indexFile.reset();
+    fileSize.resize(param.L);
+    std::vector<unsigned> buffer;
+    std::vector<unsigned> ids;
+    std::vector<DATATYPE> rows;
+    std::vector<char> bytes, kept;
+    size_t rowBytes = payload.rowBytes<DATATYPE>();
+    bool ok = true;
+    for (unsigned k = 0; k != param.L; ++k)
+    {
+        std::cout << "---------- append table " << k << " ----------" << std::endl;
+        std::string table_path = getTablePath(path, k);
+        BucketTable &table = tables[k];
+        std::vector<unsigned> &sizes = fileSize[k];
+        sizes.resize(size_t(1) << fitSplitBits, 0);
+        if (k != 0 && idOnly)
+        {
+            for (unsigned b = 0; b != table.size(); ++b)
+            {
+                table.locate(b, unsigned(table.code(b).prefix(fitSplitBits)), 0);
+            }
+            continue;
+        }
+        // the buckets of every bucket file in the order of their rows, and
+        // the files holding a bucket that receives new vectors
+        std::vector<std::vector<unsigned> > buckets(sizes.size());
+        std::vector<bool> changed(sizes.size(), false);
+        for (unsigned b = 0; b != table.size(); ++b)
+        {
+            unsigned file = unsigned(table.code(b).prefix(fitSplitBits));
+            buckets[file].push_back(b);
+            auto old = before[k].find(table.code(b));
+            if (old != before[k].end() && old->second.second == table.length(b))
+            {
+                table.locate(b, file, old->second.first);
+            }
+            else
+            {
+                changed[file] = true;
+            }
+        }
+        WriterPool writer(WRITER_FILES, size_t(APPEND_MB) * 1024 * 1024);
+        // offsets of the bucket files in the packed file, NULL if unpacked
+        std::vector<uint64_t> *offsets = packed ? &packOffsets[k] : NULL;
+        unsigned pack = packed ? writer.add(getPackPath(path, k), true) : 0;
+        for (unsigned file = 0; file != sizes.size(); ++file)
+        {
+            if (!changed[file])
+            {
+                continue;
+            }
+            // the file is written again with its live rows only, in bucket order
+            unsigned id;
+            if (packed)
+            {
+                kept.resize(size_t(sizes[file]) * rowBytes);
+                writer.read(pack, size_t((*offsets)[file]), kept.data(), kept.size());
+                (*offsets)[file] = offsets->back();
+                id = writer.region(pack, size_t((*offsets)[file]));
+            }
+            else
+            {
+                ok = readUnpacked(path, k, file, kept) && ok;
+                std::string name = table_path + "/" + getFileName(file) + ".hash";
+                id = writer.add(name + ".tmp");
+                staged.push_back(name);
+            }
+            unsigned size = 0;
+            for (auto iter = buckets[file].begin(); iter != buckets[file].end(); ++iter)
+            {
+                unsigned b = *iter;
+                table.locate(b, file, size);
+                size += table.length(b);
+                auto old = before[k].find(table.code(b));
+                unsigned count = 0;
+                if (old != before[k].end())
+                {
+                    count = old->second.second;
+                    writer.append(id, &kept[rowBytes * old->second.first], rowBytes * count);
+                }
+                // the old keys of the bucket come first, the new ones are rows of data
+                const unsigned *keys = table.decode(b, buffer);
+                ids.clear();
+                for (unsigned i = count; i != table.length(b); ++i)
+                {
+                    ids.push_back(keys[i] - first);
+                }
+                if (ids.empty())
+                {
+                    continue;
+                }
+                rows.resize(ids.size() * param.D);
+                data.getRows(ids.data(), unsigned(ids.size()), rows.data());
+                bytes.resize(rowBytes * ids.size());
+                for (unsigned i = 0; i != ids.size(); ++i)
+                {
+                    payload.encode(&rows[size_t(i) * param.D], &bytes[rowBytes * i]);
+                }
+                writer.append(id, bytes.data(), bytes.size());
+            }
+            sizes[file] = size;
+            if (packed)
+            {
+                writer.flush(id);
+                offsets->back() += PackedFile::padded(size_t(size) * rowBytes);
+            }
+        }
+        if (packed)
+        {
+            compactPack(path, k, writer, pack);
+        }
+        ok = writer.close() && ok;
+    }
+    if (!ok)
+    {
+        std::cout << "write error: " << path << std::endl;
+        for (unsigned k = 0; k != param.L; ++k)
+        {
+            ::remove((getPackPath(path, k) + ".tmp").c_str());
+        }
+        for (auto iter = staged.begin(); iter != staged.end(); ++iter)
+        {
+            ::remove((*iter + ".tmp").c_str());
+        }
+        staged.clear();
+        return false;
+    }
+    return saveFiles(path);
+}
+template<typename DATATYPE>
+lshbox::HashCode lshbox::itqLsh<DATATYPE>::getHashVal(unsigned table_id, const DATATYPE *domin)
+{
+    Eigen::RowVectorXf vals = Eigen::Map<const Eigen::Matrix<DATATYPE, 1, Eigen::Dynamic> >(domin, param.D).template cast<float>()
+                              * projection.middleCols(table_id * codeBits(), codeBits());
+    return signToCode(vals.data(), table_id);
+}
+template<typename DATATYPE>
+std::vector<lshbox::HashCode> lshbox::itqLsh<DATATYPE>::getHashVals(const DATATYPE *domin)
+{
+    Eigen::RowVectorXf vals = Eigen::Map<const Eigen::Matrix<DATATYPE, 1, Eigen::Dynamic> >(domin, param.D).template cast<float>() * projection;
+    std::vector<HashCode> codes(param.L);
+    for (unsigned k = 0; k != param.L; ++k)
+    {
+        codes[k] = signToCode(vals.data() + k * codeBits(), k);
+    }
+    return codes;
+}
+template<typename DATATYPE>
+void lshbox::itqLsh<DATATYPE>::insert(unsigned key, const DATATYPE *domin)
+{
+    thaw();
+    std::vector<HashCode> codes = getHashVals(domin);
+    for (unsigned k = 0; k != param.L; ++k)
+    {
+        pending[k][codes[k]].push_back(key);
+    }
+    hashedSize += 1;
+}
+template<typename DATATYPE>
+template<typename SCANNER>
+void lshbox::itqLsh<DATATYPE>::query(const DATATYPE *domin, SCANNER &scanner, unsigned hamming)
+{
+    freeze();
+    scanner.setTombstones(tombstones.empty() ? NULL : &tombstones);
+    scanner.reset(domin);
+    std::vector<HashCode> codes = getHashVals(domin);
+    std::vector<unsigned> buffer;
+    for (unsigned k = 0; k != param.L; ++k)
+    {
+        HashCode &hashVal = codes[k];
+        scanBuckets(k, hashVal, scanner, buffer);
+        if (hamming > 0)
+        {
+            hamming_in_k hammK(hashVal, param.N, hamming);
+            std::vector<HashCode> hashVals = hammK.generateHashVals();
+            for (auto it = hashVals.begin(); it != hashVals.end(); ++it)
+            {
+                scanBuckets(k, *it, scanner, buffer);
+            }
+        }
+    }
+    scanner.topk().genTopk();
+}
+template<typename DATATYPE>
+bool lshbox::itqLsh<DATATYPE>::save(const std::string &file)
+{
+    freeze();
+    std::ofstream out(file, std::ios::binary);
+    uint32_t version = PARAM_VERSION;
+    out.write("ITQPARAM", 8);
+    out.write((char *)&version, sizeof(uint32_t));
+    out.write((char *)&param.L, sizeof(unsigned));
+    out.write((char *)&param.D, sizeof(unsigned));
+    out.write((char *)&param.N, sizeof(unsigned));
+    out.write((char *)&param.S, sizeof(unsigned));
+    out.write((char *)&extraBits, sizeof(unsigned));
+    out.write((char *)&bucketMax, sizeof(unsigned));
+    std::vector<unsigned> buffer;
+    for (unsigned i = 0; i != param.L; ++i)
+    {
+        unsigned count = tables[i].size();
+        out.write((char *)&count, sizeof(unsigned));
+        for (unsigned b = 0; b != count; ++b)
+        {
+            tables[i].code(b).write(out, codeBits());
+            unsigned length = tables[i].length(b);
+            out.write((char *)&length, sizeof(unsigned));
+            out.write((char *)tables[i].decode(b, buffer), sizeof(unsigned) * length);
+        }
+        for (unsigned j = 0; j != param.N; ++j)
+        {
+            out.write((char *)&pcsAll[i][j][0], sizeof(float) * param.D);
+            out.write((char *)&omegasAll[i][j][0], sizeof(float) * param.N);
+        }
+        for (unsigned j = 0; j != extraBits; ++j)
+        {
+            out.write((char *)&extraPcsAll[i][j][0], sizeof(float) * param.D);
+            out.write((char *)&extraMeansAll[i][j], sizeof(float));
+        }
+    }
+    out.close();
+    return !out.fail();
+}
+template<typename DATATYPE>
+bool lshbox::itqLsh<DATATYPE>::saveIndex(const std::string &file)
+{
+    freeze();
+    IndexHeader header;
+    memcpy(header.magic, "ITQINDEX", 8);
+    header.version = INDEX_VERSION;
+    header.order = 0x01020304;
+    header.words = HashCode::WORDS;
+    header.L = param.L;
+    header.D = param.D;
+    header.N = param.N;
+    header.S = param.S;
+    header.I = param.I;
+    header.hashedSize = hashedSize;
+    header.singleMax = singleMax;
+    header.fitSplitBits = fitSplitBits;
+    header.extraBits = extraBits;
+    header.bucketMax = bucketMax;
+    std::ofstream out(file, std::ios::binary | std::ios::trunc);
+    out.write((char *)&header, sizeof(header));
+    fileSize.resize(param.L);
+    std::vector<float> matrix;
+    for (unsigned k = 0; k != param.L; ++k)
+    {
+        matrix.clear();
+        for (unsigned i = 0; i != param.N; ++i)
+        {
+            matrix.insert(matrix.end(), pcsAll[k][i].begin(), pcsAll[k][i].end());
+        }
+        for (unsigned i = 0; i != param.N; ++i)
+        {
+            matrix.insert(matrix.end(), omegasAll[k][i].begin(), omegasAll[k][i].end());
+        }
+        for (unsigned i = 0; i != extraBits; ++i)
+        {
+            matrix.insert(matrix.end(), extraPcsAll[k][i].begin(), extraPcsAll[k][i].end());
+        }
+        matrix.insert(matrix.end(), extraMeansAll[k].begin(), extraMeansAll[k].end());
+        writeAligned(out, matrix.data(), sizeof(float) * matrix.size());
+        tables[k].write(out);
+        uint64_t files = fileSize[k].size();
+        writeAligned(out, &files, sizeof(files));
+        writeAligned(out, fileSize[k].data(), sizeof(unsigned) * fileSize[k].size());
+    }
+    out.close();
+    return !out.fail();
+}
+template<typename DATATYPE>
+bool lshbox::itqLsh<DATATYPE>::mapIndex(const std::string &file)
+{
+    std::shared_ptr<MappedFile> mapped(new MappedFile);
+    if (!mapped->open(file) || mapped->size() < sizeof(IndexHeader))
+    {
+        return false;
+    }
+    const char *base = mapped->data();
+    size_t size = mapped->size();
+    IndexHeader header;
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.magic, "ITQINDEX", 8) != 0 || header.version != INDEX_VERSION
+            || header.order != 0x01020304 || header.words != HashCode::WORDS || header.N + header.extraBits > HashCode::MAX_BITS)
+    {
+        std::cout << "unsupported index: " << file << std::endl;
+        return false;
+    }
+    mapped->advise(MappedFile::RANDOM);
+    param.L = header.L;
+    param.D = header.D;
+    param.N = header.N;
+    param.S = header.S;
+    param.I = header.I;
+    hashedSize = header.hashedSize;
+    singleMax = header.singleMax;
+    fitSplitBits = header.fitSplitBits;
+    extraBits = header.extraBits;
+    bucketMax = header.bucketMax;
+    tables.assign(param.L, BucketTable());
+    pending.assign(param.L, std::map<HashCode, std::vector<unsigned> >());
+    pcsAll.assign(param.L, std::vector<std::vector<float> >(param.N));
+    omegasAll.assign(param.L, std::vector<std::vector<float> >(param.N));
+    extraPcsAll.assign(param.L, std::vector<std::vector<float> >(extraBits));
+    extraMeansAll.assign(param.L, std::vector<float>());
+    fileSize.assign(param.L, std::vector<unsigned>());
+    size_t offset = sizeof(header);
+    for (unsigned k = 0; k != param.L; ++k)
+    {
+        const float *matrix = viewAligned<float>(base, size, offset, size_t(param.N) * (param.D + param.N) + size_t(extraBits) * (param.D + 1));
+        if (matrix == NULL || !tables[k].view(base, size, offset))
+        {
+            std::cout << "truncated index: " << file << std::endl;
+            tables.assign(param.L, BucketTable());
+            return false;
+        }
+        for (unsigned i = 0; i != param.N; ++i)
+        {
+            pcsAll[k][i].assign(matrix + size_t(i) * param.D, matrix + size_t(i + 1) * param.D);
+            omegasAll[k][i].assign(matrix + size_t(param.N) * param.D + size_t(i) * param.N,
+                                   matrix + size_t(param.N) * param.D + size_t(i + 1) * param.N);
+        }
+        const float *extra = matrix + size_t(param.N) * (param.D + param.N);
+        for (unsigned i = 0; i != extraBits; ++i)
+        {
+            extraPcsAll[k][i].assign(extra + size_t(i) * param.D, extra + size_t(i + 1) * param.D);
+        }
+        extraMeansAll[k].assign(extra + size_t(extraBits) * param.D, extra + size_t(extraBits) * (param.D + 1));
+        const uint64_t *files = viewAligned<uint64_t>(base, size, offset, 1);
+        const unsigned *sizes = files == NULL ? NULL : viewAligned<unsigned>(base, size, offset, size_t(*files));
+        if (sizes == NULL)
+        {
+            std::cout << "truncated index: " << file << std::endl;
+            tables.assign(param.L, BucketTable());
+            return false;
+        }
+        fileSize[k].assign(sizes, sizes + *files);
+    }
+    indexFile = mapped;
+    fuseProjections();
+    detectIdOnly();
+    // vectors are FULL unless loadHashedFile() reads hash.payload
+    payload.reset(Payload::FULL, param.D);
+    return true;
+}
+template<typename DATATYPE>
+bool lshbox::itqLsh<DATATYPE>::load(const std::string &file)
+{
+    indexFile.reset();
+    std::ifstream in(file, std::ios::binary);
+    char magic[8] = {0};
+    uint32_t version = 0;
+    in.read(magic, 8);
+    in.read((char *)&version, sizeof(uint32_t));
+    in.read((char *)&param.L, sizeof(unsigned));
+    in.read((char *)&param.D, sizeof(unsigned));
+    in.read((char *)&param.N, sizeof(unsigned));
+    in.read((char *)&param.S, sizeof(unsigned));
+    extraBits = bucketMax = 0;
+    in.read((char *)&extraBits, sizeof(unsigned));
+    in.read((char *)&bucketMax, sizeof(unsigned));
+    // files of the original format have no header and string codes
+    if (!in || memcmp(magic, "ITQPARAM", 8) != 0 || version != PARAM_VERSION || param.L == 0 || param.N == 0
+            || param.N > param.D || uint64_t(param.N) + extraBits > HashCode::MAX_BITS)
+    {
+        std::cout << "unsupported parameter file: " << file << std::endl;
+        param.L = 0;
+        tables.clear();
+        pending.clear();
+        return false;
+    }
+    tables.assign(param.L, BucketTable());
+    pending.assign(param.L, std::map<HashCode, std::vector<unsigned> >());
+    pcsAll.resize(param.L);
+    omegasAll.resize(param.L);
+    extraPcsAll.resize(param.L);
+    extraMeansAll.resize(param.L);
+    for (unsigned i = 0; i != param.L; ++i)
+    {
+        unsigned count = 0;
+        in.read((char *)&count, sizeof(unsigned));
+        if (!in)
+        {
+            break;
+        }
+        for (unsigned j = 0; j != count && in; ++j)
+        {
+            HashCode target;
+            target.read(in, codeBits());
+            unsigned length = 0;
+            in.read((char *)&length, sizeof(unsigned));
+            if (in)
+            {
+                in.read((char *)tables[i].append(target, length), sizeof(unsigned) * length);
+            }
+        }
+        tables[i].index(param.N);
+        tables[i].setSplitMax(bucketMax);
+        if (compressKeys)
+        {
+            tables[i].compress();
+        }
+        pcsAll[i].resize(param.N);
+        omegasAll[i].resize(param.N);
+        for (unsigned j = 0; j != param.N; ++j)
+        {
+            pcsAll[i][j].resize(param.D);
+            omegasAll[i][j].resize(param.N);
+            in.read((char *)&pcsAll[i][j][0], sizeof(float) * param.D);
+            in.read((char *)&omegasAll[i][j][0], sizeof(float) * param.N);
+        }
+        extraPcsAll[i].resize(extraBits);
+        extraMeansAll[i].resize(extraBits);
+        for (unsigned j = 0; j != extraBits; ++j)
+        {
+            extraPcsAll[i][j].resize(param.D);
+            in.read((char *)&extraPcsAll[i][j][0], sizeof(float) * param.D);
+            in.read((char *)&extraMeansAll[i][j], sizeof(float));
+        }
+    }
+    if (!in)
+    {
+        std::cout << "truncated parameter file: " << file << std::endl;
+        param.L = 0;
+        tables.clear();
+        pending.clear();
+        return false;
     }
     in.close();
+    fuseProjections();
+    payload.reset(Payload::FULL, param.D);
+    return true;
 }
\ No newline at end of file
@@ -0,0 +1,474 @@
+//////////////////////////////////////////////////////////////////////////////
+/// Copyright (C) 2014 Gefu Tang <tanggefu@gmail.com>. All Rights Reserved.
+///
+/// This file is part of LSHBOX.
+///
+/// LSHBOX is free software: you can redistribute it and/or modify it under
+/// the terms of the GNU General Public License as published by the Free
+/// Software Foundation, either version 3 of the License, or(at your option)
+/// any later version.
+///
+/// LSHBOX is distributed in the hope that it will be useful, but WITHOUT
+/// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+/// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+/// more details.
+///
+/// You should have received a copy of the GNU General Public License along
+/// with LSHBOX. If not, see <http://www.gnu.org/licenses/>.
+///
+/// @version 0.1
+/// @author Gefu Tang & Zhifeng Xiao
+/// @date 2014.6.30
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @file itqsegments.h
+ *
+ * @brief File-based Iterative Quantization index made of several segments.
+ */
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <stdio.h>
+namespace lshbox
+{
+/**
+ * File-based itqLsh index made of immutable segments.
+ *
+ * The first segment is an index saved by itqLsh::tablesToFiles(), whose
+ * directory is the root of the segmented index. Every other segment is a
+ * whole index saved in S_<n>/ITQ_* under the root, hashed with the
+ * projections of the first segment, and holds the vectors following those of
+ * the segment before it. segments.list in the root records the segments, an
+ * index without it is a single segment.
+ *
+ * New vectors are added as a new segment, without touching the others, and
+ * queries scan every segment and merge their results. compact() merges the
+ * smallest neighbouring segments to bound their number. Segments keep the
+ * encoding of the vectors of the first segment, with its int8 range, see
+ * itqLsh::setPayload(). Merging keeps the buckets of every vector and
+ * copies the encoded vectors as they are.
+ */
+template<typename DATATYPE = float>
+class itqSegments
+{
+public:
+    struct Segment
+    {
+        /// Directory of the index, relative to the root
+        std::string dir;
+        /// Key of the first vector of the segment
+        unsigned first;
+        /// Number of vectors of the segment
+        unsigned size;
+    };
+    itqSegments(): maxFilesNum(1), K(0), rerankData(NULL), rerank(0) {}
+    /**
+     * Open the segmented index whose root is path.
+     */
+    void open(const std::string &path);
+    /**
+     * Hash the vectors of data into a new segment and save the list of segments.
+     *
+     * @param data    The new vectors, numbered after those of the index
+     * @param threads Number of threads used to hash the vectors
+     * @return        False if the segment or the list can not be saved, the
+     *                index is then left as it was
+     */
+    template<typename DATA>
+    bool add(DATA &data, unsigned threads = 1);
+    /**
+     * Merge the segments [first, last) into one and save the list of segments.
+     * The first segment, holding the root, is never merged, the directories
+     * of the merged segments are removed.
+     *
+     * The vectors of the merged segments are read back from the mapped bucket
+     * files of their first table, see itqLsh::Stored, so they are not held in
+     * memory, and copied as they are unless a segment has another encoding.
+     *
+     * @return False if the merged segment or the list can not be saved, the
+     *         segments are then left as they were
+     */
+    bool merge(unsigned first, unsigned last, unsigned threads = 1);
+    /**
+     * Merge the two neighbouring segments with the fewest vectors until at
+     * most max segments follow the first one.
+     *
+     * @return False if a merge fails, see merge()
+     */
+    bool compact(unsigned max, unsigned threads = 1);
+    /**
+     * Prepare the queries, as FilesScanner::init(). The bucket files kept in
+     * memory are shared equally by the segments.
+     *
+     * @return False if the scanner of a segment can not be prepared
+     */
+    bool init(unsigned maxFilesNum_, const Metric<DATATYPE> &metric_, unsigned K_)
+    {
+        maxFilesNum = maxFilesNum_;
+        metric = metric_;
+        K = K_;
+        scanners.clear();
+        bool ready = true;
+        for (unsigned i = 0; i != segments.size(); ++i)
+        {
+            ready = addScanner(i) && ready;
+        }
+        return ready;
+    }
+    /**
+     * Rank the candidates of every segment again with the exact vectors of
+     * data, as FilesScanner::setRerank(), data holding the vectors of all the
+     * keys. It applies to the scanners prepared by the next init().
+     */
+    void setRerank(FileDB<DATATYPE> *data, unsigned R)
+    {
+        rerankData = data;
+        rerank = R;
+    }
+    /**
+     * Query every segment and merge their results in topk().
+     */
+    void fileQuery(const DATATYPE *domin, unsigned hamming = 0);
+    /**
+     * Number of points scanned by the last query, in all the segments.
+     */
+    unsigned cnt() const
+    {
+        return cnt_;
+    }
+    const Topk &topk() const
+    {
+        return topk_;
+    }
+    /**
+     * Delete the vector of key from its segment and save the deleted keys of
+     * that segment.
+     *
+     * @return False if there is no such key, it was already deleted or the
+     *         deleted keys can not be saved
+     */
+    bool remove(unsigned key);
+    /**
+     * Number of vectors in all the segments.
+     */
+    unsigned getSize() const
+    {
+        return segments.empty() ? 0 : segments.back().first + segments.back().size;
+    }
+    const std::vector<Segment> &getSegments() const
+    {
+        return segments;
+    }
+    itqLsh<DATATYPE> &getIndex(unsigned i)
+    {
+        return *indexes[i];
+    }
+private:
+    /**
+     * Save the list of segments, replacing the previous one once it is written.
+     *
+     * @return False if the list can not be written, the previous one is kept
+     */
+    bool saveList();
+    /**
+     * Load segment i and put its index in indexes[i].
+     */
+    void loadSegment(unsigned i);
+    bool addScanner(unsigned i);
+    /**
+     * Name of a new segment directory.
+     */
+    std::string nextDir();
+    /**
+     * Delete the files and directories of an index that is no longer listed.
+     */
+    void removeFiles(const std::string &dir, itqLsh<DATATYPE> &lsh);
+    std::string root;
+    std::vector<Segment> segments;
+    std::vector<std::shared_ptr<itqLsh<DATATYPE> > > indexes;
+    std::vector<std::shared_ptr<FilesScanner<DATATYPE> > > scanners;
+    unsigned maxFilesNum;
+    Metric<DATATYPE> metric;
+    unsigned K;
+    FileDB<DATATYPE> *rerankData;
+    unsigned rerank;
+    Topk topk_;
+    unsigned cnt_;
+};
+}
+// ------------------------- implementation -------------------------
+template<typename DATATYPE>
+void lshbox::itqSegments<DATATYPE>::open(const std::string &path)
+{
+    root = path;
+    segments.clear();
+    indexes.clear();
+    scanners.clear();
+    std::ifstream in(root + "/segments.list");
+    Segment segment;
+    while (in >> segment.dir >> segment.first >> segment.size)
+    {
+        segments.push_back(segment);
+    }
+    in.close();
+    bool listed = !segments.empty();
+    if (!listed)
+    {
+        segment.dir = ".";
+        segment.first = 0;
+        segment.size = 0;
+        segments.push_back(segment);
+    }
+    indexes.resize(segments.size());
+    for (unsigned i = 0; i != segments.size(); ++i)
+    {
+        loadSegment(i);
+    }
+    if (!listed)
+    {
+        segments[0].size = indexes[0]->getHashedSize();
+    }
+}
+template<typename DATATYPE>
+void lshbox::itqSegments<DATATYPE>::loadSegment(unsigned i)
+{
+    indexes[i].reset(new itqLsh<DATATYPE>);
+    indexes[i]->loadHashedFile(root + "/" + segments[i].dir);
+}
+template<typename DATATYPE>
+bool lshbox::itqSegments<DATATYPE>::addScanner(unsigned i)
+{
+    itqLsh<DATATYPE> &lsh = *indexes[i];
+    unsigned files = std::max(1u, maxFilesNum / unsigned(segments.size()));
+    scanners.resize(segments.size());
+    scanners[i].reset(new FilesScanner<DATATYPE>);
+    bool ready = scanners[i]->init(lsh.getTables(), lsh.getFileSize(), lsh.getFitSplitBits(), lsh.getHashedSize(),
+                                   metric.dim(), files, root + "/" + segments[i].dir, metric, K);
+    // a segment with keys beyond data is ranked by approximate distances
+    bool exact = rerankData != NULL && segments[i].first + segments[i].size <= unsigned(rerankData->getSize());
+    scanners[i]->setRerank(exact ? rerankData : NULL, rerank, segments[i].first);
+    return ready;
+}
+template<typename DATATYPE>
+std::string lshbox::itqSegments<DATATYPE>::nextDir()
+{
+    unsigned next = 1;
+    for (unsigned i = 1; i != segments.size(); ++i)
+    {
+        next = std::max(next, unsigned(atoi(segments[i].dir.c_str() + 2)) + 1);
+    }
+    return "S_" + std::to_string(long double(next));
+}
+template<typename DATATYPE>
+bool lshbox::itqSegments<DATATYPE>::saveList()
+{
+    std::string file = root + "/segments.list";
+    std::ofstream out(file + ".tmp", std::ios::trunc);
+    for (unsigned i = 0; i != segments.size(); ++i)
+    {
+        out << segments[i].dir << " " << segments[i].first << " " << segments[i].size << std::endl;
+    }
+    out.close();
+    if (out.fail() || !replaceFile(file + ".tmp", file))
+    {
+        std::cout << "save error: " << file << std::endl;
+        ::remove((file + ".tmp").c_str());
+        return false;
+    }
+    return true;
+}
+template<typename DATATYPE>
+template<typename DATA>
+bool lshbox::itqSegments<DATATYPE>::add(DATA &data, unsigned threads)
+{
+    assert(data.getDim() == indexes[0]->getParam().D);
+    itqLsh<DATATYPE> lsh(*indexes[0]);
+    lsh.clear();
+    lsh.hash(data, threads);
+    std::string dir = nextDir();
+    _mkdir((root + "/" + dir).c_str());
+    if (!lsh.tablesToFiles(root + "/" + dir, data, indexes[0]->getSingleMax(), threads))
+    {
+        return false;
+    }
+    Segment segment;
+    segment.dir = dir + "/" + lsh.getHashSavePath();
+    segment.first = getSize();
+    segment.size = lsh.getHashedSize();
+    segments.push_back(segment);
+    if (!saveList())
+    {
+        segments.pop_back();
+        removeFiles(segment.dir, lsh);
+        return false;
+    }
+    indexes.resize(segments.size());
+    loadSegment(unsigned(segments.size() - 1));
+    if (K != 0)
+    {
+        init(maxFilesNum, metric, K);
+    }
+    return true;
+}
+template<typename DATATYPE>
+bool lshbox::itqSegments<DATATYPE>::merge(unsigned first, unsigned last, unsigned threads)
+{
+    assert(first >= 1 && first < last && last <= segments.size());
+    if (last - first < 2)
+    {
+        return true;
+    }
+    unsigned begin = segments[first].first;
+    unsigned size = segments[last - 1].first + segments[last - 1].size - begin;
+    itqLsh<DATATYPE> lsh(*indexes[0]);
+    lsh.clear();
+    std::string dir = nextDir();
+    {
+        // the vectors are read from the bucket files of the merged segments
+        typename itqLsh<DATATYPE>::Stored stored;
+        for (unsigned i = first; i != last; ++i)
+        {
+            if (!stored.add(*indexes[i], root + "/" + segments[i].dir))
+            {
+                return false;
+            }
+        }
+        lsh.hash(stored, threads);
+        _mkdir((root + "/" + dir).c_str());
+        if (!lsh.tablesToFiles(root + "/" + dir, stored, indexes[0]->getSingleMax(), threads))
+        {
+            return false;
+        }
+    }
+    std::string path = root + "/" + dir + "/" + lsh.getHashSavePath();
+    // the keys deleted in the merged segments stay deleted
+    for (unsigned i = first; i != last; ++i)
+    {
+        const Tombstones &deleted = indexes[i]->getTombstones();
+        for (unsigned key = 0; key != segments[i].size && deleted.count() != 0; ++key)
+        {
+            if (deleted.deleted(key))
+            {
+                lsh.remove(segments[i].first - begin + key);
+            }
+        }
+    }
+    Segment segment;
+    segment.dir = dir + "/" + lsh.getHashSavePath();
+    segment.first = begin;
+    segment.size = size;
+    if (!lsh.getTombstones().empty() && !lsh.saveTombstones(path))
+    {
+        removeFiles(segment.dir, lsh);
+        return false;
+    }
+    // the merged segments are listed until the new list is saved
+    std::vector<Segment> listed(segments);
+    std::vector<Segment> merged(segments.begin() + first, segments.begin() + last);
+    segments.erase(segments.begin() + first + 1, segments.begin() + last);
+    segments[first] = segment;
+    if (!saveList())
+    {
+        segments.swap(listed);
+        removeFiles(segment.dir, lsh);
+        return false;
+    }
+    std::vector<std::shared_ptr<itqLsh<DATATYPE> > > old(indexes.begin() + first, indexes.begin() + last);
+    indexes.erase(indexes.begin() + first + 1, indexes.begin() + last);
+    loadSegment(first);
+    scanners.clear();
+    for (unsigned i = 0; i != merged.size(); ++i)
+    {
+        removeFiles(merged[i].dir, *old[i]);
+    }
+    old.clear();
+    if (K != 0)
+    {
+        init(maxFilesNum, metric, K);
+    }
+    return true;
+}
+template<typename DATATYPE>
+bool lshbox::itqSegments<DATATYPE>::compact(unsigned max, unsigned threads)
+{
+    while (segments.size() > max + 1 && segments.size() > 2)
+    {
+        unsigned best = 1;
+        for (unsigned i = 2; i + 1 < segments.size(); ++i)
+        {
+            if (segments[i].size + segments[i + 1].size < segments[best].size + segments[best + 1].size)
+            {
+                best = i;
+            }
+        }
+        if (!merge(best, best + 2, threads))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+template<typename DATATYPE>
+void lshbox::itqSegments<DATATYPE>::removeFiles(const std::string &dir, itqLsh<DATATYPE> &lsh)
+{
+    std::string path = root + "/" + dir;
+    std::vector<std::vector<unsigned> > &fileSize = lsh.getFileSize();
+    for (unsigned k = 0; k != fileSize.size(); ++k)
+    {
+        std::string table_path = lsh.getTablePath(path, k);
+        for (unsigned file = 0; file != fileSize[k].size(); ++file)
+        {
+            if (fileSize[k][file] != 0)
+            {
+                ::remove((table_path + "/" + lsh.getFileName(file) + ".hash").c_str());
+            }
+        }
+        _rmdir(table_path.c_str());
+        ::remove(lsh.getPackPath(path, k).c_str());
+    }
+    const char *names[] = {"hash.param", "hash.file.pos", "hash.index", "hash.deleted", "hash.payload", "hash.pack"};
+    for (unsigned i = 0; i != 6; ++i)
+    {
+        ::remove((path + "/" + names[i]).c_str());
+    }
+    _rmdir(path.c_str());
+    _rmdir(path.substr(0, path.rfind('/')).c_str());
+}
+template<typename DATATYPE>
+void lshbox::itqSegments<DATATYPE>::fileQuery(const DATATYPE *domin, unsigned hamming)
+{
+    topk_.reset(K);
+    cnt_ = 0;
+    for (unsigned i = 0; i != segments.size(); ++i)
+    {
+        FilesScanner<DATATYPE> &scanner = *scanners[i];
+        indexes[i]->fileQuery(domin, scanner, hamming);
+        cnt_ += scanner.cnt();
+        const std::vector<std::pair<float, unsigned> > &tops = scanner.topk().getTopk();
+        for (auto iter = tops.begin(); iter != tops.end(); ++iter)
+        {
+            topk_.push(segments[i].first + iter->second, iter->first);
+        }
+    }
+    topk_.genTopk();
+}
+template<typename DATATYPE>
+bool lshbox::itqSegments<DATATYPE>::remove(unsigned key)
+{
+    for (unsigned i = 0; i != segments.size(); ++i)
+    {
+        if (key >= segments[i].first && key < segments[i].first + segments[i].size)
+        {
+            if (!indexes[i]->remove(key - segments[i].first))
+            {
+                return false;
+            }
+            return indexes[i]->saveTombstones(root + "/" + segments[i].dir);
+        }
+    }
+    return false;
+}
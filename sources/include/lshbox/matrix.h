@@ -29,6 +29,7 @@
 #pragma once
 #include <fstream>
 #include <vector>
+#include <algorithm>
 #include <assert.h>
 #include <string.h>
 namespace lshbox
@@ -103,6 +104,16 @@ public:
     {
         return N;
     }
+    /**
+     * Copy the vectors ids[0 .. count) into rows, one row after another.
+     */
+    void getRows(const unsigned *ids, unsigned count, T *rows) const
+    {
+        for (unsigned i = 0; i != count; ++i)
+        {
+            memcpy(rows + size_t(i) * dim, dims + size_t(ids[i]) * dim, sizeof(T) * dim);
+        }
+    }
     /**
      * Get the data.
      */
@@ -211,5 +222,31 @@ public:
             return matrix_[key];
         }
     };
+    /**
+     * Sequential reader over a range of vectors, same interface as
+     * FileDB<T>::Reader. The chunks point straight into the matrix, so there
+     * is nothing to read ahead and the last argument is ignored.
+     */
+    class Reader
+    {
+    public:
+        Reader(const Matrix &matrix, unsigned begin, unsigned end, unsigned chunk = 0, bool = false)
+            : matrix_(matrix), next_(begin), end_(end), pos_(begin), chunk_(chunk ? chunk : 4096) {}
+        unsigned next(const T *&vecs)
+        {
+            pos_ = next_;
+            unsigned count = std::min(chunk_, end_ - next_);
+            vecs = matrix_[next_];
+            next_ += count;
+            return count;
+        }
+        unsigned position() const
+        {
+            return pos_;
+        }
+    private:
+        const Matrix &matrix_;
+        unsigned next_, end_, pos_, chunk_;
+    };
 };
 }
\ No newline at end of file
@@ -65,6 +65,13 @@ public:
     {
         return dim_;
     }
+    /**
+     * Get the way to measure the distance, L1_DIST or L2_DIST
+     */
+    unsigned type() const
+    {
+        return type_;
+    }
     /**
      * measure the distance.
      *
@@ -0,0 +1,194 @@
+//////////////////////////////////////////////////////////////////////////////
+/// Copyright (C) 2014 Gefu Tang <tanggefu@gmail.com>. All Rights Reserved.
+///
+/// This file is part of LSHBOX.
+///
+/// LSHBOX is free software: you can redistribute it and/or modify it under
+/// the terms of the GNU General Public License as published by the Free
+/// Software Foundation, either version 3 of the License, or(at your option)
+/// any later version.
+///
+/// LSHBOX is distributed in the hope that it will be useful, but WITHOUT
+/// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+/// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+/// more details.
+///
+/// You should have received a copy of the GNU General Public License along
+/// with LSHBOX. If not, see <http://www.gnu.org/licenses/>.
+///
+/// @version 0.1
+/// @author Gefu Tang & Zhifeng Xiao
+/// @date 2014.6.30
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @file mmap.h
+ *
+ * @brief Read-only memory mapped files.
+ */
+#pragma once
+#include <string>
+#include <stddef.h>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+namespace lshbox
+{
+/**
+ * A whole file mapped read-only into memory.
+ *
+ * The mapping is shared with the page cache, so several processes mapping the
+ * same file share one copy of it.
+ */
+class MappedFile
+{
+public:
+    /**
+     * Access pattern hints, see madvise(2).
+     */
+    enum Advice
+    {
+        NORMAL,
+        SEQUENTIAL,
+        RANDOM,
+        WILLNEED
+    };
+    MappedFile(): data_(NULL), size_(0)
+    {
+#ifdef _WIN32
+        file_ = INVALID_HANDLE_VALUE;
+        mapping_ = NULL;
+#endif
+    }
+    ~MappedFile()
+    {
+        close();
+    }
+    /**
+     * Map a file, return false if it can not be opened or is empty.
+     */
+    bool open(const std::string &path)
+    {
+        close();
+#ifdef _WIN32
+        file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file_ == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+        LARGE_INTEGER size;
+        GetFileSizeEx(file_, &size);
+        size_ = size_t(size.QuadPart);
+        if (size_ != 0)
+        {
+            mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (mapping_ != NULL)
+            {
+                data_ = (const char *)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+            }
+        }
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat st;
+        fstat(fd, &st);
+        size_ = size_t(st.st_size);
+        if (size_ != 0)
+        {
+            void *addr = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+            data_ = addr == MAP_FAILED ? NULL : (const char *)addr;
+        }
+        ::close(fd);
+#endif
+        if (data_ == NULL)
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+    void close()
+    {
+#ifdef _WIN32
+        if (data_ != NULL)
+        {
+            UnmapViewOfFile(data_);
+        }
+        if (mapping_ != NULL)
+        {
+            CloseHandle(mapping_);
+        }
+        if (file_ != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(file_);
+        }
+        file_ = INVALID_HANDLE_VALUE;
+        mapping_ = NULL;
+#else
+        if (data_ != NULL)
+        {
+            munmap((void *)data_, size_);
+        }
+#endif
+        data_ = NULL;
+        size_ = 0;
+    }
+    /**
+     * Give the kernel a hint about how a part of the mapping will be accessed.
+     *
+     * @param advice The access pattern
+     * @param offset The first byte of the part
+     * @param length The length of the part, 0 means up to the end
+     */
+    void advise(Advice advice, size_t offset = 0, size_t length = 0)
+    {
+        if (data_ == NULL || offset >= size_)
+        {
+            return;
+        }
+        if (length == 0 || offset + length > size_)
+        {
+            length = size_ - offset;
+        }
+#ifndef _WIN32
+        // madvise needs a page aligned address
+        size_t page = size_t(sysconf(_SC_PAGESIZE));
+        size_t begin = offset / page * page;
+        int flags[] = {MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED};
+        madvise((void *)(data_ + begin), length + offset - begin, flags[advice]);
+#endif
+    }
+    const char *data() const
+    {
+        return data_;
+    }
+    size_t size() const
+    {
+        return size_;
+    }
+    bool isOpen() const
+    {
+        return data_ != NULL;
+    }
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator = (const MappedFile &);
+    const char *data_;
+    size_t size_;
+#ifdef _WIN32
+    HANDLE file_;
+    HANDLE mapping_;
+#endif
+};
+}
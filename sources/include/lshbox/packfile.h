@@ -0,0 +1,225 @@
+//////////////////////////////////////////////////////////////////////////////
+/// Copyright (C) 2014 Gefu Tang <tanggefu@gmail.com>. All Rights Reserved.
+///
+/// This file is part of LSHBOX.
+///
+/// LSHBOX is free software: you can redistribute it and/or modify it under
+/// the terms of the GNU General Public License as published by the Free
+/// Software Foundation, either version 3 of the License, or(at your option)
+/// any later version.
+///
+/// LSHBOX is distributed in the hope that it will be useful, but WITHOUT
+/// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+/// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+/// more details.
+///
+/// You should have received a copy of the GNU General Public License along
+/// with LSHBOX. If not, see <http://www.gnu.org/licenses/>.
+///
+/// @version 0.1
+/// @author Gefu Tang & Zhifeng Xiao
+/// @date 2014.6.30
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @file packfile.h
+ *
+ * @brief The bucket files of a table packed in one file.
+ */
+#pragma once
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+namespace lshbox
+{
+/**
+ * A file holding the bucket files of a table one after another, every one in
+ * an extent starting at a multiple of ALIGN bytes.
+ *
+ * The extents follow the order of the bucket files, empty ones take no space,
+ * so their offsets are found from the sizes of the bucket files by extents().
+ * A bucket file that changes later is written in a new extent after the last
+ * one, the offsets are then saved by saveExtents().
+ * The file stays open and is read with positioned reads, which touch no
+ * metadata of the file system.
+ */
+class PackedFile
+{
+public:
+    /// Alignment of the extents in bytes
+    static const size_t ALIGN = 4096;
+    PackedFile()
+    {
+#ifdef _WIN32
+        handle_ = INVALID_HANDLE_VALUE;
+#else
+        fd_ = -1;
+#endif
+    }
+    ~PackedFile()
+    {
+        close();
+    }
+    /**
+     * Offset of the extent of every bucket file, followed by the size of the
+     * packed file.
+     *
+     * @param sizes    Number of vectors in every bucket file
+     * @param rowBytes Bytes of a vector
+     */
+    static void extents(const std::vector<unsigned> &sizes, size_t rowBytes, std::vector<uint64_t> &offsets)
+    {
+        offsets.resize(sizes.size() + 1);
+        uint64_t offset = 0;
+        for (unsigned file = 0; file != sizes.size(); ++file)
+        {
+            offsets[file] = offset;
+            offset += padded(sizes[file] * rowBytes);
+        }
+        offsets[sizes.size()] = offset;
+    }
+    /**
+     * Save the offsets of the extents of every table, each followed by the
+     * end of the used part of its packed file.
+     *
+     * @return False if the file can not be written
+     */
+    static bool saveExtents(const std::string &file, const std::vector<std::vector<uint64_t> > &offsets)
+    {
+        std::ofstream out(file.c_str(), std::ios::binary | std::ios::trunc);
+        uint32_t tables = uint32_t(offsets.size());
+        out.write((char *)&tables, sizeof(uint32_t));
+        for (unsigned k = 0; k != offsets.size(); ++k)
+        {
+            uint32_t count = uint32_t(offsets[k].size());
+            out.write((char *)&count, sizeof(uint32_t));
+            out.write((char *)offsets[k].data(), sizeof(uint64_t) * count);
+        }
+        out.close();
+        return !out.fail();
+    }
+    /**
+     * Load the offsets saved by saveExtents().
+     *
+     * @return False if the file is missing or truncated, offsets is then empty
+     */
+    static bool loadExtents(const std::string &file, std::vector<std::vector<uint64_t> > &offsets)
+    {
+        std::ifstream in(file.c_str(), std::ios::binary);
+        uint32_t tables = 0;
+        in.read((char *)&tables, sizeof(uint32_t));
+        offsets.resize(in ? tables : 0);
+        for (unsigned k = 0; k != offsets.size() && in; ++k)
+        {
+            uint32_t count = 0;
+            in.read((char *)&count, sizeof(uint32_t));
+            offsets[k].resize(in ? count : 0);
+            in.read((char *)offsets[k].data(), sizeof(uint64_t) * offsets[k].size());
+        }
+        if (!in)
+        {
+            offsets.clear();
+            return false;
+        }
+        return true;
+    }
+    /**
+     * Bytes of an extent holding bytes of data.
+     */
+    static uint64_t padded(uint64_t bytes)
+    {
+        return (bytes + ALIGN - 1) / ALIGN * ALIGN;
+    }
+    /**
+     * Open a packed file for reading, return false if it can not be opened.
+     */
+    bool open(const std::string &path)
+    {
+        close();
+        path_ = path;
+#ifdef _WIN32
+        handle_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        return handle_ != INVALID_HANDLE_VALUE;
+#else
+        fd_ = ::open(path.c_str(), O_RDONLY);
+        return fd_ >= 0;
+#endif
+    }
+    /**
+     * Read bytes from offset.
+     */
+    bool read(uint64_t offset, void *data, size_t bytes) const
+    {
+        char *out = (char *)data;
+        while (bytes != 0)
+        {
+#ifdef _WIN32
+            OVERLAPPED at;
+            memset(&at, 0, sizeof(at));
+            at.Offset = DWORD(offset);
+            at.OffsetHigh = DWORD(offset >> 32);
+            DWORD done = 0;
+            if (!ReadFile(handle_, out, DWORD(std::min<size_t>(bytes, 1u << 30)), &done, &at) || done == 0)
+#else
+            ssize_t done = pread(fd_, out, bytes, off_t(offset));
+            if (done <= 0)
+#endif
+            {
+                std::cout << "read error: " << path_ << std::endl;
+                return false;
+            }
+            out += done;
+            offset += done;
+            bytes -= done;
+        }
+        return true;
+    }
+    void close()
+    {
+#ifdef _WIN32
+        if (handle_ != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(handle_);
+        }
+        handle_ = INVALID_HANDLE_VALUE;
+#else
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+        }
+        fd_ = -1;
+#endif
+    }
+    bool isOpen() const
+    {
+#ifdef _WIN32
+        return handle_ != INVALID_HANDLE_VALUE;
+#else
+        return fd_ >= 0;
+#endif
+    }
+private:
+    PackedFile(const PackedFile &);
+    PackedFile &operator = (const PackedFile &);
+    std::string path_;
+#ifdef _WIN32
+    HANDLE handle_;
+#else
+    int fd_;
+#endif
+};
+}
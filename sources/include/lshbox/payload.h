@@ -0,0 +1,313 @@
+//////////////////////////////////////////////////////////////////////////////
+/// Copyright (C) 2014 Gefu Tang <tanggefu@gmail.com>. All Rights Reserved.
+///
+/// This file is part of LSHBOX.
+///
+/// LSHBOX is free software: you can redistribute it and/or modify it under
+/// the terms of the GNU General Public License as published by the Free
+/// Software Foundation, either version 3 of the License, or(at your option)
+/// any later version.
+///
+/// LSHBOX is distributed in the hope that it will be useful, but WITHOUT
+/// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+/// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+/// more details.
+///
+/// You should have received a copy of the GNU General Public License along
+/// with LSHBOX. If not, see <http://www.gnu.org/licenses/>.
+///
+/// @version 0.1
+/// @author Gefu Tang & Zhifeng Xiao
+/// @date 2014.6.30
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @file payload.h
+ *
+ * @brief Reduced precision vectors in the bucket files.
+ */
+#pragma once
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cmath>
+#include <string.h>
+#include <float.h>
+#include <stdint.h>
+namespace lshbox
+{
+/**
+ * Encoding of the vectors in the bucket files.
+ *
+ * FULL keeps the vectors as they are. HALF stores every number as a 16 bits
+ * float. INT8 stores every number as a byte, scaled over the range of its
+ * dimension in the hashed data, numbers out of the range are clamped.
+ * Distances to the encoded vectors are computed without decoding them into
+ * a buffer, they only approximate the exact distances.
+ */
+class Payload
+{
+public:
+    enum Type
+    {
+        FULL = 0,
+        HALF = 1,
+        INT8 = 2
+    };
+    Payload(): type_(FULL), dim_(0) {}
+    /**
+     * Set the encoding of vectors of dim numbers, the range of INT8 is then
+     * empty until fit() widens it.
+     */
+    void reset(Type type, unsigned dim)
+    {
+        type_ = type;
+        dim_ = dim;
+        low_.assign(type_ == INT8 ? dim_ : 0, FLT_MAX);
+        high_.assign(type_ == INT8 ? dim_ : 0, -FLT_MAX);
+        step_.assign(type_ == INT8 ? dim_ : 0, 1.0f);
+        buildHalfTable();
+    }
+    Type type() const
+    {
+        return type_;
+    }
+    bool reduced() const
+    {
+        return type_ != FULL;
+    }
+    /**
+     * Whether this encodes vectors of dim numbers and its range, for INT8,
+     * is fitted and sealed.
+     */
+    bool fitted(unsigned dim) const
+    {
+        return dim_ == dim && (low_.empty() || low_[0] <= high_[0]);
+    }
+    /**
+     * Whether other encodes every vector into the same bytes as this.
+     */
+    bool equals(const Payload &other) const
+    {
+        return type_ == other.type_ && dim_ == other.dim_ && low_ == other.low_ && high_ == other.high_;
+    }
+    /**
+     * Bytes of an encoded vector of T.
+     */
+    template<typename T>
+    size_t rowBytes() const
+    {
+        return type_ == FULL ? sizeof(T) * dim_ : type_ == HALF ? 2 * dim_ : dim_;
+    }
+    /**
+     * Widen the range of INT8 to the count vectors of rows.
+     */
+    template<typename T>
+    void fit(const T *rows, unsigned count)
+    {
+        for (unsigned i = 0; i != count && type_ == INT8; ++i)
+        {
+            const T *row = rows + size_t(i) * dim_;
+            for (unsigned d = 0; d != dim_; ++d)
+            {
+                low_[d] = std::min(low_[d], float(row[d]));
+                high_[d] = std::max(high_[d], float(row[d]));
+            }
+        }
+    }
+    /**
+     * Widen the range of INT8 to the range of other.
+     */
+    void fit(const Payload &other)
+    {
+        for (unsigned d = 0; d != low_.size(); ++d)
+        {
+            low_[d] = std::min(low_[d], other.low_[d]);
+            high_[d] = std::max(high_[d], other.high_[d]);
+        }
+    }
+    /**
+     * Fix the scale of INT8 once the range is fitted.
+     */
+    void seal()
+    {
+        for (unsigned d = 0; d != low_.size(); ++d)
+        {
+            if (low_[d] > high_[d])
+            {
+                low_[d] = high_[d] = 0;
+            }
+            step_[d] = high_[d] > low_[d] ? (high_[d] - low_[d]) / 255 : 1.0f;
+        }
+    }
+    template<typename T>
+    void encode(const T *vec, char *row) const
+    {
+        switch (type_)
+        {
+        case FULL:
+            memcpy(row, vec, sizeof(T) * dim_);
+            break;
+        case HALF:
+            for (unsigned d = 0; d != dim_; ++d)
+            {
+                uint16_t half = floatToHalf(float(vec[d]));
+                memcpy(row + 2 * d, &half, 2);
+            }
+            break;
+        case INT8:
+            for (unsigned d = 0; d != dim_; ++d)
+            {
+                float level = std::floor((float(vec[d]) - low_[d]) / step_[d] + 0.5f);
+                ((uint8_t *)row)[d] = uint8_t(std::min(255.0f, std::max(0.0f, level)));
+            }
+            break;
+        }
+    }
+    template<typename T>
+    void decode(const char *row, T *vec) const
+    {
+        if (type_ == FULL)
+        {
+            memcpy(vec, row, sizeof(T) * dim_);
+            return;
+        }
+        for (unsigned d = 0; d != dim_; ++d)
+        {
+            vec[d] = T(value(row, d));
+        }
+    }
+    /**
+     * Distance between query and an encoded vector.
+     *
+     * @param metric L1_DIST or L2_DIST
+     */
+    template<typename T>
+    float dist(unsigned metric, const T *query, const char *row) const
+    {
+        float dist_ = 0;
+        if (metric == L1_DIST)
+        {
+            for (unsigned d = 0; d != dim_; ++d)
+            {
+                dist_ += std::abs(float(query[d]) - value(row, d));
+            }
+            return dist_;
+        }
+        for (unsigned d = 0; d != dim_; ++d)
+        {
+            float diff = float(query[d]) - value(row, d);
+            dist_ += diff * diff;
+        }
+        return std::sqrt(dist_);
+    }
+    /**
+     * Save the encoding and the range of INT8.
+     *
+     * @return False if the file can not be written
+     */
+    bool save(const std::string &file) const
+    {
+        std::ofstream out(file, std::ios::binary | std::ios::trunc);
+        unsigned type = type_;
+        out.write((char *)&type, sizeof(unsigned));
+        out.write((char *)&dim_, sizeof(unsigned));
+        out.write((char *)low_.data(), sizeof(float) * low_.size());
+        out.write((char *)high_.data(), sizeof(float) * high_.size());
+        out.close();
+        return !out.fail();
+    }
+    /**
+     * Load the encoding saved in file, vectors of dim numbers are FULL if
+     * there is no such file.
+     */
+    void load(const std::string &file, unsigned dim)
+    {
+        std::ifstream in(file, std::ios::binary);
+        unsigned type = FULL;
+        in.read((char *)&type, sizeof(unsigned));
+        in.read((char *)&dim, sizeof(unsigned));
+        reset(in ? Type(type) : FULL, dim);
+        in.read((char *)low_.data(), sizeof(float) * low_.size());
+        in.read((char *)high_.data(), sizeof(float) * high_.size());
+        in.close();
+        seal();
+    }
+private:
+    float value(const char *row, unsigned d) const
+    {
+        if (type_ == HALF)
+        {
+            uint16_t half;
+            memcpy(&half, row + 2 * d, 2);
+            return halfTable_[half];
+        }
+        return low_[d] + step_[d] * ((const uint8_t *)row)[d];
+    }
+    /**
+     * Float of every 16 bits float, for HALF.
+     */
+    void buildHalfTable()
+    {
+        halfTable_.clear();
+        if (type_ != HALF)
+        {
+            return;
+        }
+        halfTable_.resize(1 << 16);
+        for (unsigned half = 0; half != halfTable_.size(); ++half)
+        {
+            unsigned exponent = (half >> 10) & 31, mantissa = half & 1023;
+            float value;
+            if (exponent == 0)
+            {
+                value = std::ldexp(float(mantissa), -24);
+            }
+            else if (exponent == 31)
+            {
+                value = mantissa == 0 ? FLT_MAX : 0.0f;
+            }
+            else
+            {
+                value = std::ldexp(float(mantissa | 1024), int(exponent) - 25);
+            }
+            halfTable_[half] = (half & 0x8000) ? -value : value;
+        }
+    }
+    /**
+     * Nearest 16 bits float, numbers too large are saturated.
+     */
+    static uint16_t floatToHalf(float value)
+    {
+        uint16_t sign = value < 0 ? 0x8000 : 0;
+        value = std::abs(value);
+        if (!(value < 65520.0f))
+        {
+            return sign | 0x7bff;
+        }
+        int exponent;
+        float fraction = std::frexp(value, &exponent);
+        if (value == 0 || exponent < -24)
+        {
+            return sign;
+        }
+        // value = fraction * 2^exponent, 0.5 <= fraction < 1
+        if (exponent < -13)
+        {
+            return sign | uint16_t(std::floor(std::ldexp(value, 24) + 0.5f));
+        }
+        unsigned mantissa = unsigned(std::floor(std::ldexp(fraction, 11) + 0.5f));
+        if (mantissa == 2048)
+        {
+            mantissa = 1024;
+            ++exponent;
+        }
+        return sign | uint16_t(((exponent + 14) << 10) | (mantissa & 1023));
+    }
+    Type type_;
+    unsigned dim_;
+    /// Range of every dimension and its step between two levels, for INT8
+    std::vector<float> low_, high_, step_;
+    std::vector<float> halfTable_;
+};
+}
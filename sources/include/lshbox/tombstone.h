@@ -0,0 +1,130 @@
+//////////////////////////////////////////////////////////////////////////////
+/// Copyright (C) 2014 Gefu Tang <tanggefu@gmail.com>. All Rights Reserved.
+///
+/// This file is part of LSHBOX.
+///
+/// LSHBOX is free software: you can redistribute it and/or modify it under
+/// the terms of the GNU General Public License as published by the Free
+/// Software Foundation, either version 3 of the License, or(at your option)
+/// any later version.
+///
+/// LSHBOX is distributed in the hope that it will be useful, but WITHOUT
+/// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+/// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+/// more details.
+///
+/// You should have received a copy of the GNU General Public License along
+/// with LSHBOX. If not, see <http://www.gnu.org/licenses/>.
+///
+/// @version 0.1
+/// @author Gefu Tang & Zhifeng Xiao
+/// @date 2014.6.30
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @file tombstone.h
+ *
+ * @brief Deleted keys of an index.
+ */
+#pragma once
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdint.h>
+namespace lshbox
+{
+/**
+ * Bitmap of the deleted keys of an index.
+ *
+ * Keys are deleted by setting their bit, the buckets and bucket files are
+ * left as they are and the scanners skip the deleted keys. The bitmap is
+ * saved as the number of keys it covers followed by its words.
+ */
+class Tombstones
+{
+public:
+    Tombstones(): size_(0), count_(0) {}
+    /**
+     * Delete key, return false if it was already deleted.
+     */
+    bool erase(unsigned key)
+    {
+        if (key >= size_)
+        {
+            size_ = key + 1;
+            words_.resize((size_ + 63) / 64, 0);
+        }
+        uint64_t bit = uint64_t(1) << (key & 63);
+        if (words_[key >> 6] & bit)
+        {
+            return false;
+        }
+        words_[key >> 6] |= bit;
+        ++count_;
+        return true;
+    }
+    /**
+     * Whether key is deleted.
+     */
+    bool deleted(unsigned key) const
+    {
+        return key < size_ && ((words_[key >> 6] >> (key & 63)) & 1) != 0;
+    }
+    /**
+     * Number of deleted keys.
+     */
+    unsigned count() const
+    {
+        return count_;
+    }
+    bool empty() const
+    {
+        return count_ == 0;
+    }
+    void clear()
+    {
+        std::vector<uint64_t>().swap(words_);
+        size_ = count_ = 0;
+    }
+    /**
+     * Save the bitmap in file.
+     *
+     * @return False if the file can not be written
+     */
+    bool save(const std::string &file) const
+    {
+        std::ofstream out(file, std::ios::binary | std::ios::trunc);
+        out.write((char *)&size_, sizeof(unsigned));
+        out.write((char *)words_.data(), sizeof(uint64_t) * words_.size());
+        out.close();
+        return !out.fail();
+    }
+    /**
+     * Load the bitmap saved in file, it is left empty if there is no such file.
+     */
+    void load(const std::string &file)
+    {
+        clear();
+        std::ifstream in(file, std::ios::binary);
+        if (!in.read((char *)&size_, sizeof(unsigned)))
+        {
+            size_ = 0;
+            return;
+        }
+        words_.resize((size_ + 63) / 64, 0);
+        in.read((char *)words_.data(), sizeof(uint64_t) * words_.size());
+        for (unsigned i = 0; i != words_.size(); ++i)
+        {
+            for (uint64_t word = words_[i]; word != 0; word &= word - 1)
+            {
+                ++count_;
+            }
+        }
+        in.close();
+    }
+private:
+    std::vector<uint64_t> words_;
+    unsigned size_;
+    unsigned count_;
+};
+}
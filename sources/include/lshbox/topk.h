@@ -33,6 +33,7 @@
 #include <string>
 #include <iostream>
 #include <algorithm>
+#include <deque>
 namespace lshbox
 {
 /**
@@ -286,7 +287,7 @@ public:
         const ACCESSOR &accessor,
         const Metric<DATATYPE> &metric,
         unsigned K
-    ): accessor_(accessor), metric_(metric), K_(K), cnt_(0) {}
+    ): accessor_(accessor), metric_(metric), K_(K), cnt_(0), deleted_(NULL) {}
     void resetK(unsigned K)
     {
         if (K_ != K)
@@ -295,6 +296,13 @@ public:
             topk_.reset(K_);
         }
     }
+    /**
+     * Skip the keys deleted in tombstones, NULL scans every key.
+     */
+    void setTombstones(const Tombstones *tombstones)
+    {
+        deleted_ = tombstones;
+    }
     /**
       * Reset the query, this function should be invoked before each query.
       */
@@ -332,6 +340,10 @@ public:
      */
     void operator () (unsigned key)
     {
+        if (deleted_ != NULL && deleted_->deleted(key))
+        {
+            return;
+        }
         if (accessor_.mark(key))
         {
             ++cnt_;
@@ -345,32 +357,51 @@ private:
     Value query_;
     unsigned K_;
     unsigned cnt_;
+    const Tombstones *deleted_;
 };
 
+/**
+ * Top-K scanner over the vectors stored in the bucket files of an index.
+ *
+ * At most maxFilesNum bucket files are kept in memory, the oldest loaded file
+ * is dropped first. If only the first table has bucket files, they are mapped
+ * instead and hold the vectors of the keys of every table. Vectors encoded by
+ * a Payload are compared by approximate distances, and the best candidates
+ * can be ranked again by their exact vectors, see setRerank(). The bucket
+ * files of a packed index are read from the packed file of their table, kept
+ * open, see itqLsh::setPacked().
+ */
 template<typename DATATYPE>
 class FilesScanner
 {
 public:
-    FilesScanner() {}
+    FilesScanner(): deleted_(NULL), payload_(NULL), rerankData_(NULL), rerank_(0), rerankOffset_(0),
+        idOnly_(false), tables(0), fileSize(0) {}
     FilesScanner(
-        std::vector<std::map<std::string, std::vector<unsigned> > > &tables_,
-        std::vector<std::map<std::string, std::pair<std::string, unsigned> > > &hashPos_,
-        std::vector<std::map<std::string, unsigned> > &fileSize_,
+        const std::vector<BucketTable> &tables_,
+        const std::vector<std::vector<unsigned> > &fileSize_,
+        unsigned fitSplitBits_,
         unsigned N_,
         unsigned dim_,
         unsigned maxFilesNum_,
         std::string hashSavePath_,
         const Metric<DATATYPE> &metric,
         unsigned K
-    ): tables(tables_), hashPos(hashPos_), fileSize(fileSize_), maxFilesNum(maxFilesNum_), N(N_), dim(dim_), hashSavePath(hashSavePath_), metric_(metric), K_(K), cnt_(0)
+    ): deleted_(NULL), payload_(NULL), rerankData_(NULL), rerank_(0), rerankOffset_(0),
+        idOnly_(false), tables(0), fileSize(0)
     {
-        flags_.resize(N);
-        // fillFilesDB();
+        init(tables_, fileSize_, fitSplitBits_, N_, dim_, maxFilesNum_, hashSavePath_, metric, K);
     }
-    void init(
-        std::vector<std::map<std::string, std::vector<unsigned> > > &tables_,
-        std::vector<std::map<std::string, std::pair<std::string, unsigned> > > &hashPos_,
-        std::vector<std::map<std::string, unsigned> > &fileSize_,
+    /**
+     * Prepare the scanner for the index in hashSavePath_.
+     *
+     * @return False if the bucket files of the first table of an ID-only
+     *         index can not be mapped, queries then find no vectors
+     */
+    bool init(
+        const std::vector<BucketTable> &tables_,
+        const std::vector<std::vector<unsigned> > &fileSize_,
+        unsigned fitSplitBits_,
         unsigned N_,
         unsigned dim_,
         unsigned maxFilesNum_,
@@ -379,10 +410,11 @@ public:
         unsigned K
     )
     {
-        tables = tables_;
-        hashPos = hashPos_;
-        fileSize = fileSize_;
-        maxFilesNum = maxFilesNum_;
+        clearFiles();
+        tables = &tables_;
+        fileSize = &fileSize_;
+        fitSplitBits = fitSplitBits_;
+        maxFilesNum = std::max(1u, maxFilesNum_);
         N = N_;
         dim = dim_;
         hashSavePath = hashSavePath_;
@@ -390,18 +422,19 @@ public:
         K_ = K;
         cnt_ = 0;
         flags_.resize(N);
-        // fillFilesDB();
+        filesDB.resize(fileSize_.size());
+        for (unsigned table_id = 0; table_id != filesDB.size(); ++table_id)
+        {
+            filesDB[table_id].assign(fileSize_[table_id].size(), NULL);
+        }
+        openPacks();
+        idOnly_ = fileSize_.size() > 1 && N != 0
+                  && size_t(std::count(fileSize_[1].begin(), fileSize_[1].end(), 0u)) == fileSize_[1].size();
+        return !idOnly_ || mapFirstTable();
     }
     ~FilesScanner()
     {
-        for (auto iter = filesDB.begin(); iter != filesDB.end(); ++iter)
-        {
-            if (iter->second != NULL)
-            {
-                delete [] iter->second;
-            }
-        }
-        filesDB.clear();
+        clearFiles();
     }
     void resetK(unsigned K)
     {
@@ -411,30 +444,65 @@ public:
             topk_.reset(K_);
         }
     }
-    void reset(DATATYPE *query)
+    /**
+     * Skip the keys deleted in tombstones, NULL scans every key.
+     */
+    void setTombstones(const Tombstones *tombstones)
+    {
+        deleted_ = tombstones;
+    }
+    /**
+     * Decode the bucket files with payload, NULL if they hold DATATYPE. The
+     * files in memory are dropped if it changes.
+     */
+    void setPayload(const Payload *payload)
+    {
+        if (payload != payload_)
+        {
+            payload_ = payload;
+            dropFiles();
+            buildExtents();
+        }
+    }
+    /**
+     * Rank the R nearest candidates by approximate distance again with their
+     * exact vectors read from data, when the bucket files are encoded, and
+     * keep the K nearest. The key of a candidate in data is key + offset.
+     * NULL data ranks the candidates by approximate distance only.
+     */
+    void setRerank(FileDB<DATATYPE> *data, unsigned R, unsigned offset = 0)
+    {
+        rerankData_ = data;
+        rerank_ = R;
+        rerankOffset_ = offset;
+    }
+    void reset(const DATATYPE *query)
     {
         query_ = query;
-        topk_.reset(K_);
+        topk_.reset(reranking() ? std::max(K_, rerank_) : K_);
         cnt_ = 0;
         flags_.clear();
         flags_.resize(N);
     }
     void fillFilesDB()
     {
-        unsigned cnt = 0;
-        for (unsigned table_id = 0; table_id != hashPos.size(); ++table_id)
+        if (idOnly_)
         {
-            for (auto iter = hashPos[table_id].begin(); iter != hashPos[table_id].end(); ++iter)
+            return;
+        }
+        for (unsigned table_id = 0; table_id != filesDB.size(); ++table_id)
+        {
+            for (unsigned file = 0; file != filesDB[table_id].size(); ++file)
             {
-                std::string file = iter->first;
-                auto key = std::make_pair(table_id, file);
-                filesDB[key] = new DATATYPE[fileSize[table_id][file] * dim];
-                std::ifstream in(hashSavePath + "/L_" + std::to_string(long double(table_id)) + "/" + file + ".hash", std::ios::binary);
-                in.read((char *)filesDB[key], fileSize[table_id][file] * dim * sizeof(DATATYPE));
-                if (++cnt == maxFilesNum)
+                if ((*fileSize)[table_id][file] == 0 || filesDB[table_id][file] != NULL)
+                {
+                    continue;
+                }
+                if (loaded.size() == maxFilesNum)
                 {
                     return;
                 }
+                useFile(table_id, file);
             }
         }
     }
@@ -459,26 +527,74 @@ public:
     {
         return topk_;
     }
-    DATATYPE *useFile(unsigned table_id, std::string hashVal)
+    /**
+     * Generate the TopK results once the buckets are scanned, ranked again by
+     * the exact vectors if set by setRerank().
+     */
+    void genTopk()
+    {
+        topk_.genTopk();
+        if (!reranking())
+        {
+            return;
+        }
+        std::vector<std::pair<float, unsigned> > &tops = topk_.getTopk();
+        std::vector<unsigned> ids(tops.size());
+        for (unsigned i = 0; i != tops.size(); ++i)
+        {
+            ids[i] = tops[i].second + rerankOffset_;
+        }
+        // the exact vectors are gathered in the order of the data
+        std::sort(ids.begin(), ids.end());
+        std::vector<DATATYPE> rows(ids.size() * dim);
+        rerankData_->getRows(ids.data(), unsigned(ids.size()), rows.data());
+        for (unsigned i = 0; i != ids.size(); ++i)
+        {
+            tops[i] = std::make_pair(metric_.dist(query_, &rows[size_t(i) * dim]), ids[i] - rerankOffset_);
+        }
+        std::sort(tops.begin(), tops.end());
+        tops.resize(std::min<size_t>(tops.size(), K_));
+    }
+    std::string getFilePath(unsigned table_id, unsigned file)
+    {
+        return hashSavePath + "/L_" + std::to_string(long double(table_id)) + "/" + bitsToString(file, fitSplitBits) + ".hash";
+    }
+    /**
+     * The packed file of a table, see itqLsh::getPackPath().
+     */
+    std::string getPackPath(unsigned table_id)
+    {
+        return hashSavePath + "/L_" + std::to_string(long double(table_id)) + ".pack";
+    }
+    /**
+     * The vectors of a bucket file, read from disk if it is not in memory.
+     */
+    const char *useFile(unsigned table_id, unsigned file)
     {
-        std::string file = hashPos[table_id][hashVal].first;
-        auto key = std::make_pair(table_id, file);
-        auto iter = filesDB.find(key);
-        if (iter == filesDB.end())
+        char *&vecs = filesDB[table_id][file];
+        if (vecs == NULL)
         {
-            if (filesDB.size() == maxFilesNum)
+            if (loaded.size() == maxFilesNum)
             {
-                if (filesDB.begin()->second != NULL)
-                {
-                    delete [] filesDB.begin()->second;
-                }
-                filesDB.erase(filesDB.begin());
+                std::pair<unsigned, unsigned> oldest = loaded.front();
+                loaded.pop_front();
+                delete [] filesDB[oldest.first][oldest.second];
+                filesDB[oldest.first][oldest.second] = NULL;
+            }
+            size_t count = size_t((*fileSize)[table_id][file]) * rowBytes();
+            vecs = new char[count];
+            if (packs_[table_id] != NULL)
+            {
+                packs_[table_id]->read(extents_[table_id][file], vecs, count);
+            }
+            else
+            {
+                std::ifstream in(getFilePath(table_id, file), std::ios::binary);
+                in.read(vecs, count);
             }
-            filesDB[key] = new DATATYPE[fileSize[table_id][file] * dim];
-            std::ifstream in(hashSavePath + "/L_" + std::to_string(long double(table_id)) + "/" + file + ".hash", std::ios::binary);
-            in.read((char *)filesDB[key], fileSize[table_id][file] * dim * sizeof(DATATYPE));
+            loaded.push_back(std::make_pair(table_id, file));
         }
-        return filesDB[key];
+        return vecs;
     }
     bool mark(unsigned key)
     {
@@ -489,32 +605,242 @@ public:
         flags_[key] = true;
         return true;
     }
-    void insert(unsigned table_id, std::string hashVal)
+    void insert(unsigned table_id, const HashCode &hashVal)
     {
-        DATATYPE *vecs = useFile(table_id, hashVal);
-        std::vector<unsigned> &keys = tables[table_id][hashVal];
-        unsigned &pos = hashPos[table_id][hashVal].second;
-        for (unsigned i = 0; i != keys.size(); ++i)
+        const BucketTable &table = (*tables)[table_id];
+        unsigned first, last;
+        if ((idOnly_ && mapped_.empty()) || !table.probe(hashVal, first, last))
         {
-            if (mark(keys[i]))
+            return;
+        }
+        for (unsigned bucket = first; bucket != last; ++bucket)
+        {
+            const unsigned *keys = table.decode(bucket, buffer_);
+            if (idOnly_ && table_id != 0)
             {
-                ++cnt_;
-                topk_.push(keys[i], metric_.dist(query_, vecs + (pos + i) * dim));
+                insertKeys(keys, table.length(bucket));
+                continue;
+            }
+            size_t bytes = rowBytes();
+            const char *vecs = idOnly_ ? mappedVecs(table.file(bucket)) + table.position(bucket) * bytes
+                               : useFile(table_id, table.file(bucket)) + table.position(bucket) * bytes;
+            unsigned length = table.length(bucket);
+            for (unsigned i = 0; i != length; ++i)
+            {
+                if (deleted_ != NULL && deleted_->deleted(keys[i]))
+                {
+                    continue;
+                }
+                if (mark(keys[i]))
+                {
+                    ++cnt_;
+                    topk_.push(keys[i], dist(vecs + i * bytes));
+                }
             }
         }
     }
 private:
+    bool reranking() const
+    {
+        return rerankData_ != NULL && payload_ != NULL && payload_->reduced();
+    }
+    /**
+     * Bytes of a vector in the bucket files.
+     */
+    size_t rowBytes() const
+    {
+        return payload_ == NULL ? sizeof(DATATYPE) * dim : payload_->rowBytes<DATATYPE>();
+    }
+    /**
+     * Distance between the query and a vector of the bucket files.
+     */
+    float dist(const char *row) const
+    {
+        if (payload_ == NULL || !payload_->reduced())
+        {
+            return metric_.dist(query_, (const DATATYPE *)row);
+        }
+        return payload_->dist(metric_.type(), query_, row);
+    }
+    /**
+     * The vectors of a bucket file of the first table, mapped in place.
+     */
+    const char *mappedVecs(unsigned file) const
+    {
+        if (packs_[0] != NULL)
+        {
+            return mapped_[0]->data() + extents_[0][file];
+        }
+        return mapped_[file]->data();
+    }
+    /**
+     * Open the packed file of every table with bucket files, if the index is
+     * packed.
+     */
+    void openPacks()
+    {
+        packs_.assign(fileSize->size(), NULL);
+        for (unsigned table_id = 0; table_id != packs_.size(); ++table_id)
+        {
+            const std::vector<unsigned> &sizes = (*fileSize)[table_id];
+            if (size_t(std::count(sizes.begin(), sizes.end(), 0u)) == sizes.size())
+            {
+                continue;
+            }
+            packs_[table_id] = new PackedFile;
+            if (!packs_[table_id]->open(getPackPath(table_id)))
+            {
+                delete packs_[table_id];
+                packs_[table_id] = NULL;
+            }
+        }
+        buildExtents();
+    }
+    /**
+     * Offsets of the bucket files in the packed files, read from hash.pack,
+     * else laid out by PackedFile::extents() with the bytes of a vector.
+     */
+    void buildExtents()
+    {
+        extents_.clear();
+        PackedFile::loadExtents(hashSavePath + "/hash.pack", extents_);
+        extents_.resize(packs_.size());
+        for (unsigned table_id = 0; table_id != packs_.size(); ++table_id)
+        {
+            if (packs_[table_id] != NULL && extents_[table_id].size() != (*fileSize)[table_id].size() + 1)
+            {
+                PackedFile::extents((*fileSize)[table_id], rowBytes(), extents_[table_id]);
+            }
+        }
+    }
+    /**
+     * Map the bucket files of the first table, and record for every key the
+     * file and position of its vector, to find the keys of the other tables.
+     *
+     * @return False if a file can not be mapped, none is then kept
+     */
+    bool mapFirstTable()
+    {
+        const BucketTable &table = (*tables)[0];
+        const std::vector<unsigned> &sizes = (*fileSize)[0];
+        mapped_.assign(sizes.size(), NULL);
+        for (unsigned file = 0; file != sizes.size(); ++file)
+        {
+            // the packed file is mapped once, in the place of the first file
+            if (packs_[0] != NULL ? file != 0 : sizes[file] == 0)
+            {
+                continue;
+            }
+            std::string path = packs_[0] != NULL ? getPackPath(0) : getFilePath(0, file);
+            mapped_[file] = new MappedFile;
+            if (!mapped_[file]->open(path))
+            {
+                std::cout << "map error: " << path << std::endl;
+                unmapFirstTable();
+                return false;
+            }
+            mapped_[file]->advise(MappedFile::RANDOM);
+        }
+        keyFile_.resize(N);
+        keyPos_.resize(N);
+        for (unsigned bucket = 0; bucket != table.size(); ++bucket)
+        {
+            const unsigned *keys = table.decode(bucket, buffer_);
+            for (unsigned i = 0; i != table.length(bucket); ++i)
+            {
+                keyFile_[keys[i]] = table.file(bucket);
+                keyPos_[keys[i]] = table.position(bucket) + i;
+            }
+        }
+        return true;
+    }
+    void unmapFirstTable()
+    {
+        for (unsigned file = 0; file != mapped_.size(); ++file)
+        {
+            delete mapped_[file];
+        }
+        mapped_.clear();
+    }
+    /**
+     * Scan keys of a table without bucket files, their vectors are found in
+     * the files of the first table.
+     */
+    void insertKeys(const unsigned *keys, unsigned length)
+    {
+        for (unsigned i = 0; i != length; ++i)
+        {
+            unsigned key = keys[i];
+            if (deleted_ != NULL && deleted_->deleted(key))
+            {
+                continue;
+            }
+            if (mark(key))
+            {
+                ++cnt_;
+                topk_.push(key, dist(mappedVecs(keyFile_[key]) + keyPos_[key] * rowBytes()));
+            }
+        }
+    }
+    void clearFiles()
+    {
+        unmapFirstTable();
+        dropFiles();
+        filesDB.clear();
+        for (unsigned table_id = 0; table_id != packs_.size(); ++table_id)
+        {
+            delete packs_[table_id];
+        }
+        packs_.clear();
+        extents_.clear();
+    }
+    /**
+     * Drop the bucket files in memory.
+     */
+    void dropFiles()
+    {
+        for (unsigned table_id = 0; table_id != filesDB.size(); ++table_id)
+        {
+            for (unsigned file = 0; file != filesDB[table_id].size(); ++file)
+            {
+                delete [] filesDB[table_id][file];
+                filesDB[table_id][file] = NULL;
+            }
+        }
+        loaded.clear();
+    }
     Metric<DATATYPE> metric_;
     Topk topk_;
-    DATATYPE *query_;
+    const DATATYPE *query_;
     unsigned K_;
     unsigned cnt_;
     std::vector<bool> flags_;
-    std::map<std::pair<unsigned, std::string>, DATATYPE *> filesDB;
-    unsigned N, dim, maxFilesNum;
+    const Tombstones *deleted_;
+    /// Encoding of the bucket files, NULL if they hold DATATYPE
+    const Payload *payload_;
+    /// Exact vectors of the candidates ranked again, see setRerank()
+    FileDB<DATATYPE> *rerankData_;
+    unsigned rerank_, rerankOffset_;
+    /// Whether only the first table has bucket files, see itqLsh::setIdOnly()
+    bool idOnly_;
+    /// The mapped bucket files of the first table, or its mapped packed file first, if idOnly_
+    std::vector<MappedFile *> mapped_;
+    /// The file of the first table holding every key and its position, if idOnly_
+    std::vector<unsigned> keyFile_, keyPos_;
+    /// Keys of the bucket being scanned, if the keys are compressed
+    std::vector<unsigned> buffer_;
+    /// The packed file of every table, NULL if its bucket files are not packed
+    std::vector<PackedFile *> packs_;
+    /// Offset of every bucket file in the packed file of its table
+    std::vector<std::vector<uint64_t> > extents_;
+    /// The bucket files in memory by table and file, NULL if not loaded
+    std::vector<std::vector<char *> > filesDB;
+    /// The bucket files in memory in the order they were loaded
+    std::deque<std::pair<unsigned, unsigned> > loaded;
+    unsigned N, dim, maxFilesNum, fitSplitBits;
     std::string hashSavePath;
-    std::vector<std::map<std::string, std::vector<unsigned> > > tables;
-    std::vector<std::map<std::string, std::pair<std::string, unsigned> > > hashPos;
-    std::vector<std::map<std::string, unsigned> > fileSize;
+    /// The tables of the index, which must outlive the scanner
+    const std::vector<BucketTable> *tables;
+    const std::vector<std::vector<unsigned> > *fileSize;
 };
-}
\ No newline at end of file
+}
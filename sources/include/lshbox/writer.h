@@ -0,0 +1,396 @@
+//////////////////////////////////////////////////////////////////////////////
+/// Copyright (C) 2014 Gefu Tang <tanggefu@gmail.com>. All Rights Reserved.
+///
+/// This file is part of LSHBOX.
+///
+/// LSHBOX is free software: you can redistribute it and/or modify it under
+/// the terms of the GNU General Public License as published by the Free
+/// Software Foundation, either version 3 of the License, or(at your option)
+/// any later version.
+///
+/// LSHBOX is distributed in the hope that it will be useful, but WITHOUT
+/// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+/// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+/// more details.
+///
+/// You should have received a copy of the GNU General Public License along
+/// with LSHBOX. If not, see <http://www.gnu.org/licenses/>.
+///
+/// @version 0.1
+/// @author Gefu Tang & Zhifeng Xiao
+/// @date 2014.6.30
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @file writer.h
+ *
+ * @brief Buffered writers of many files through a bounded number of descriptors.
+ */
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <iostream>
+#include <algorithm>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+namespace lshbox
+{
+/**
+ * Writes many files, each through its own append buffer, with at most
+ * maxOpen of them open at once.
+ *
+ * The buffer of a file is written in one piece once it holds chunk bytes, so
+ * a file is written with a few large writes at offsets multiple of chunk. A
+ * file is opened when it is first written and stays open until the pool is
+ * full, then the file opened first is closed. close() writes what is left in
+ * the buffers, syncs every file once, opening again those closed early, and
+ * closes them. A region of a file, see region(), is written like a file of
+ * its own through the descriptor of that file. Errors are reported by close().
+ */
+class WriterPool
+{
+public:
+    /**
+     * @param maxOpen Number of files open at once
+     * @param chunk   Size of the append buffer of every file in bytes
+     */
+    explicit WriterPool(unsigned maxOpen = 64, size_t chunk = 1 << 20): maxOpen_(std::max(1u, maxOpen)), chunk_(std::max<size_t>(chunk, 1)), failed_(false) {}
+    ~WriterPool()
+    {
+        close();
+    }
+    /**
+     * Add a file to the pool and return its id. The file is created empty,
+     * unless append is set, then the new data follows its content.
+     */
+    unsigned add(const std::string &path, bool append = false)
+    {
+        File file;
+        file.path = path;
+        file.size = 0;
+        file.created = append;
+        file.synced = true;
+        file.parent = unsigned(files_.size());
+        file.base = 0;
+#ifdef _WIN32
+        file.handle = INVALID_HANDLE_VALUE;
+#else
+        file.fd = -1;
+#endif
+        if (append)
+        {
+            struct stat st;
+            if (stat(path.c_str(), &st) == 0)
+            {
+                file.size = size_t(st.st_size);
+            }
+        }
+        files_.push_back(file);
+        return unsigned(files_.size() - 1);
+    }
+    /**
+     * Add the region of file id starting at offset base and return its id.
+     * The region is empty, it is written and read from base on, and must not
+     * overlap the other regions written.
+     */
+    unsigned region(unsigned id, size_t base)
+    {
+        File file = files_[id];
+        file.buffer.clear();
+        file.size = 0;
+        file.base = files_[id].base + base;
+#ifdef _WIN32
+        file.handle = INVALID_HANDLE_VALUE;
+#else
+        file.fd = -1;
+#endif
+        files_.push_back(file);
+        return unsigned(files_.size() - 1);
+    }
+    /**
+     * Append bytes to the end of file id.
+     */
+    void append(unsigned id, const void *data, size_t bytes)
+    {
+        std::vector<char> &buffer = files_[id].buffer;
+        if (buffer.capacity() < chunk_)
+        {
+            buffer.reserve(chunk_);
+        }
+        if (buffer.size() + bytes < chunk_)
+        {
+            buffer.insert(buffer.end(), (const char *)data, (const char *)data + bytes);
+            return;
+        }
+        size_t head = chunk_ - buffer.size();
+        if (buffer.empty())
+        {
+            head = 0;
+        }
+        else
+        {
+            buffer.insert(buffer.end(), (const char *)data, (const char *)data + head);
+            flush(id);
+        }
+        // whole chunks go straight to the file, the rest is kept
+        size_t whole = (bytes - head) / chunk_ * chunk_;
+        if (whole != 0)
+        {
+            writeFile(id, files_[id].size, (const char *)data + head, whole);
+            files_[id].size += whole;
+        }
+        buffer.assign((const char *)data + head + whole, (const char *)data + bytes);
+    }
+    /**
+     * Write the buffer of file id.
+     */
+    void flush(unsigned id)
+    {
+        std::vector<char> &buffer = files_[id].buffer;
+        if (!buffer.empty())
+        {
+            writeFile(id, files_[id].size, buffer.data(), buffer.size());
+            files_[id].size += buffer.size();
+            buffer.clear();
+        }
+    }
+    /**
+     * Size of file id, including its buffer.
+     */
+    size_t size(unsigned id) const
+    {
+        return files_[id].size + files_[id].buffer.size();
+    }
+    /**
+     * Read bytes of file id from offset, after writing its buffer if they
+     * are not all in the file yet.
+     */
+    void read(unsigned id, size_t offset, void *data, size_t bytes)
+    {
+        if (offset + bytes > files_[id].size)
+        {
+            flush(id);
+        }
+        char *out = (char *)data;
+        unsigned parent = files_[id].parent;
+        offset += files_[id].base;
+        while (bytes != 0)
+        {
+#ifdef _WIN32
+            OVERLAPPED at = overlapped(offset);
+            DWORD done = 0;
+            if (!ReadFile(use(parent), out, DWORD(std::min<size_t>(bytes, 1u << 30)), &done, &at) || done == 0)
+#else
+            ssize_t done = pread(use(parent), out, bytes, off_t(offset));
+            if (done <= 0)
+#endif
+            {
+                std::cout << "read error: " << files_[id].path << std::endl;
+                failed_ = true;
+                return;
+            }
+            out += done;
+            offset += done;
+            bytes -= done;
+        }
+    }
+    /**
+     * Write bytes over file id from offset, after writing its buffer.
+     */
+    void write(unsigned id, size_t offset, const void *data, size_t bytes)
+    {
+        flush(id);
+        writeFile(id, offset, (const char *)data, bytes);
+        files_[id].size = std::max(files_[id].size, offset + bytes);
+    }
+    /**
+     * Write the buffers, sync the files written since they were added and
+     * close them. The pool is then empty.
+     *
+     * @return False if a file could not be opened, read, written or synced
+     *         since the pool was last closed
+     */
+    bool close()
+    {
+        for (unsigned id = 0; id != files_.size(); ++id)
+        {
+            flush(id);
+        }
+        for (unsigned id = 0; id != files_.size(); ++id)
+        {
+            if (files_[id].parent != id)
+            {
+                continue;
+            }
+            if (!files_[id].synced)
+            {
+#ifdef _WIN32
+                if (!FlushFileBuffers(use(id)))
+#else
+                if (fsync(use(id)) != 0)
+#endif
+                {
+                    std::cout << "sync error: " << files_[id].path << std::endl;
+                    failed_ = true;
+                }
+            }
+            closeFile(id);
+        }
+        files_.clear();
+        opened_.clear();
+        bool ok = !failed_;
+        failed_ = false;
+        return ok;
+    }
+private:
+    struct File
+    {
+        std::string path;
+        std::vector<char> buffer;
+        /// Bytes in the file, without the buffer
+        size_t size;
+        /// Whether the file was created, it is then reopened as it is
+        bool created;
+        bool synced;
+        /// The file holding a region, and the offset of the region in it
+        unsigned parent;
+        size_t base;
+#ifdef _WIN32
+        HANDLE handle;
+#else
+        int fd;
+#endif
+    };
+    WriterPool(const WriterPool &);
+    WriterPool &operator = (const WriterPool &);
+#ifdef _WIN32
+    static OVERLAPPED overlapped(size_t offset)
+    {
+        OVERLAPPED at;
+        memset(&at, 0, sizeof(at));
+        at.Offset = DWORD(offset);
+        at.OffsetHigh = DWORD(uint64_t(offset) >> 32);
+        return at;
+    }
+    HANDLE use(unsigned id)
+#else
+    int use(unsigned id)
+#endif
+    {
+        File &file = files_[id];
+#ifdef _WIN32
+        if (file.handle != INVALID_HANDLE_VALUE)
+        {
+            return file.handle;
+        }
+#else
+        if (file.fd >= 0)
+        {
+            return file.fd;
+        }
+#endif
+        if (opened_.size() == maxOpen_)
+        {
+            closeFile(opened_.front());
+        }
+#ifdef _WIN32
+        file.handle = CreateFileA(file.path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                                  file.created ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file.handle == INVALID_HANDLE_VALUE)
+#else
+        file.fd = ::open(file.path.c_str(), O_RDWR | O_CREAT | (file.created ? 0 : O_TRUNC), 0644);
+        if (file.fd < 0)
+#endif
+        {
+            std::cout << "open error: " << file.path << std::endl;
+            failed_ = true;
+        }
+        file.created = true;
+        opened_.push_back(id);
+#ifdef _WIN32
+        return file.handle;
+#else
+        return file.fd;
+#endif
+    }
+    void writeFile(unsigned id, size_t offset, const char *data, size_t bytes)
+    {
+        unsigned parent = files_[id].parent;
+        files_[parent].synced = false;
+        offset += files_[id].base;
+        while (bytes != 0)
+        {
+#ifdef _WIN32
+            OVERLAPPED at = overlapped(offset);
+            DWORD done = 0;
+            if (!WriteFile(use(parent), data, DWORD(std::min<size_t>(bytes, 1u << 30)), &done, &at) || done == 0)
+#else
+            ssize_t done = pwrite(use(parent), data, bytes, off_t(offset));
+            if (done <= 0)
+#endif
+            {
+                std::cout << "write error: " << files_[id].path << std::endl;
+                failed_ = true;
+                return;
+            }
+            data += done;
+            offset += done;
+            bytes -= done;
+        }
+    }
+    void closeFile(unsigned id)
+    {
+        File &file = files_[id];
+#ifdef _WIN32
+        if (file.handle == INVALID_HANDLE_VALUE)
+        {
+            return;
+        }
+        CloseHandle(file.handle);
+        file.handle = INVALID_HANDLE_VALUE;
+#else
+        if (file.fd < 0)
+        {
+            return;
+        }
+        ::close(file.fd);
+        file.fd = -1;
+#endif
+        opened_.erase(std::find(opened_.begin(), opened_.end(), id));
+    }
+    unsigned maxOpen_;
+    size_t chunk_;
+    std::vector<File> files_;
+    /// Ids of the open files in the order they were opened
+    std::deque<unsigned> opened_;
+    /// Whether an operation failed since the pool was last closed
+    bool failed_;
+};
+/**
+ * Rename from over to, replacing to if it exists. Readers of to see either
+ * the old or the new file, never a part of it.
+ *
+ * @return False if the file can not be renamed
+ */
+inline bool replaceFile(const std::string &from, const std::string &to)
+{
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return ::rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+}
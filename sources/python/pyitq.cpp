@@ -156,7 +156,9 @@ public:
         unsigned L = 5,
         unsigned N = 8,
         unsigned S = 100,
-        unsigned I = 50)
+        unsigned I = 50,
+        unsigned threads = 1,
+        unsigned batchRows = 0)
     {
         timer tmr;
         std::cout << "LOADING DATA ..." << std::endl;
@@ -172,9 +174,10 @@ public:
         param.S = S;
         param.I = I;
         lsh.reset(param);
-        lsh.train(data);
-        lsh.hash(data);
-        lsh.tablesToFiles(hash_save_main_path, data, singleMax);
+        lsh.setBatchRows(batchRows);
+        lsh.train(data, threads);
+        lsh.hash(data, threads);
+        lsh.tablesToFiles(hash_save_main_path, data, singleMax, threads);
         std::cout << "CONSTRUCTING TIME: " << tmr.elapsed() << "s." << std::endl;
     }
     void load_hash(
@@ -199,8 +202,8 @@ public:
         Metric<DATATYPE> metric(data.getDim(), type);
         filesSanner.init(
             lsh.getTables(),
-            lsh.getHashPos(),
             lsh.getFileSize(),
+            lsh.getFitSplitBits(),
             lsh.getHashedSize(),
             data.getDim(),
             max_memory / lsh.getSingleMax(),
@@ -254,7 +257,7 @@ BOOST_PYTHON_MODULE(libpyitq)
         .def("init_mat", &lshbox::pyItqLshM::init_mat, (arg("source"), arg("index"), arg("L") = 5, arg("N") = 8, arg("S") = 1000, arg("I") = 50))
         .def("query", &lshbox::pyItqLshM::query, (arg("quy"), arg("type") = 2, arg("K") = 10, arg("H") = 0));
     class_<lshbox::pyItqLshF>("itq_f")
-        .def("save_hash", &lshbox::pyItqLshF::save_hash, (arg("data_path"), arg("hash_save_main_path"), arg("L") = 5, arg("N") = 8, arg("S") = 1000, arg("I") = 50))
+        .def("save_hash", &lshbox::pyItqLshF::save_hash, (arg("data_path"), arg("hash_save_main_path"), arg("singleMax") = 50, arg("L") = 5, arg("N") = 8, arg("S") = 1000, arg("I") = 50, arg("threads") = 1, arg("batchRows") = 0))
         .def("load_hash", &lshbox::pyItqLshF::load_hash, (arg("data_path"), arg("hash_save_path"), arg("type") = 2, arg("K") = 10, arg("max_memory") = 4096))
         .def("query", &lshbox::pyItqLshF::query, (arg("quy"), arg("K") = 10, arg("H") = 0));
 }
\ No newline at end of file
@@ -0,0 +1,174 @@
+//////////////////////////////////////////////////////////////////////////////
+/// Copyright (C) 2014 Gefu Tang <tanggefu@gmail.com>. All Rights Reserved.
+///
+/// This file is part of LSHBOX.
+///
+/// LSHBOX is free software: you can redistribute it and/or modify it under
+/// the terms of the GNU General Public License as published by the Free
+/// Software Foundation, either version 3 of the License, or(at your option)
+/// any later version.
+///
+/// LSHBOX is distributed in the hope that it will be useful, but WITHOUT
+/// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+/// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+/// more details.
+///
+/// You should have received a copy of the GNU General Public License along
+/// with LSHBOX. If not, see <http://www.gnu.org/licenses/>.
+///
+/// @version 0.1
+/// @author Gefu Tang & Zhifeng Xiao
+/// @date 2014.6.30
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @file check.h
+ *
+ * @brief Helpers shared by the tests: small datasets on disk, queries through
+ * itqSegments as dbitq_loads runs them, and comparison of their results.
+ */
+#pragma once
+#include <lshbox.h>
+#include <fstream>
+#include <random>
+/**
+ * Count a failed condition and report where it is, the test then returns
+ * the number of failures.
+ */
+#define CHECK(cond) \
+    do \
+    { \
+        if (!(cond)) \
+        { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " << #cond << std::endl; \
+            ++failures; \
+        } \
+    } while (0)
+static unsigned failures = 0;
+typedef std::vector<std::vector<std::pair<float, unsigned> > > Results;
+/**
+ * count vectors of dim numbers around a few random, overlapping centers, so
+ * the buckets of a table are of uneven sizes and the top K of a vector
+ * spreads over several buckets.
+ */
+inline std::vector<float> makeVectors(unsigned count, unsigned dim, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> center(0.0f, 2.0f), noise(0.0f, 1.0f);
+    std::vector<float> centers(16 * dim);
+    for (unsigned i = 0; i != centers.size(); ++i)
+    {
+        centers[i] = center(rng);
+    }
+    std::vector<float> vecs(size_t(count) * dim);
+    for (unsigned i = 0; i != count; ++i)
+    {
+        unsigned c = rng() % 16;
+        for (unsigned d = 0; d != dim; ++d)
+        {
+            vecs[size_t(i) * dim + d] = centers[c * dim + d] + noise(rng);
+        }
+    }
+    return vecs;
+}
+/**
+ * Save the vectors [begin, end) as a FileDB dataset in path, in one batch
+ * file named as FileDB::getBatchFile() names it.
+ */
+inline void saveDataset(const std::string &path, const std::vector<float> &vecs, unsigned dim, unsigned begin, unsigned end)
+{
+    _mkdir(path.c_str());
+    _mkdir((path + "/dataset").c_str());
+    std::ofstream meta(path + "/dataset/data.meta");
+    meta << "DIMENSIONS = " << dim << std::endl;
+    meta << "TOTAL_SIZE = " << end - begin << std::endl;
+    meta << "BATCH_SIZE = " << end - begin << std::endl;
+    std::ofstream out(path + "/dataset/data_" + std::to_string(long double(0)) + ".bin", std::ios::binary | std::ios::trunc);
+    out.write((const char *)&vecs[size_t(begin) * dim], sizeof(float) * dim * (end - begin));
+}
+/**
+ * Whether data holds the vectors [begin, end), as saveDataset() wrote them.
+ */
+inline bool sameDataset(lshbox::FileDB<float> &data, const std::vector<float> &vecs, unsigned begin, unsigned end)
+{
+    unsigned dim = data.getDim();
+    if (data.getSize() != end - begin)
+    {
+        return false;
+    }
+    for (unsigned i = begin; i < end; i += (end - begin) / 7 + 1)
+    {
+        if (memcmp(data[i - begin], &vecs[size_t(i) * dim], sizeof(float) * dim) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+/**
+ * A directory under base that did not exist, so a test never reads the
+ * files of a previous run.
+ */
+inline std::string freshDir(const std::string &base)
+{
+    _mkdir(base.c_str());
+    for (unsigned run = 0;; ++run)
+    {
+        std::string dir = base + "/run_" + std::to_string(long double(run));
+        if (_mkdir(dir.c_str()) == 0)
+        {
+            return dir;
+        }
+    }
+}
+/**
+ * The top K of every query vector of data, from the index in path with its
+ * segments, probing only the buckets of the codes of the queries, ranked
+ * again by the exact vectors of data if rerank is not 0.
+ */
+inline Results query(const std::string &path, lshbox::FileDB<float> &data, const std::vector<unsigned> &queries,
+                     unsigned K, unsigned rerank = 0)
+{
+    lshbox::itqSegments<float> lsh;
+    lsh.open(path);
+    if (rerank != 0)
+    {
+        lsh.setRerank(&data, rerank);
+    }
+    lshbox::Metric<float> metric(data.getDim(), L2_DIST);
+    CHECK(lsh.init(64, metric, K));
+    Results results;
+    for (unsigned i = 0; i != queries.size(); ++i)
+    {
+        lsh.fileQuery(data[queries[i]], 0);
+        results.push_back(lsh.topk().getTopk());
+    }
+    return results;
+}
+/**
+ * Whether two results hold the same keys in the same order, at distances
+ * equal up to rounding.
+ */
+inline bool sameResults(const Results &a, const Results &b)
+{
+    if (a.size() != b.size())
+    {
+        return false;
+    }
+    for (unsigned i = 0; i != a.size(); ++i)
+    {
+        if (a[i].size() != b[i].size())
+        {
+            return false;
+        }
+        for (unsigned j = 0; j != a[i].size(); ++j)
+        {
+            float diff = std::abs(a[i][j].first - b[i][j].first);
+            if (a[i][j].second != b[i][j].second || diff > 1e-4f * std::max(1.0f, a[i][j].first))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,118 @@
+//////////////////////////////////////////////////////////////////////////////
+/// Copyright (C) 2014 Gefu Tang <tanggefu@gmail.com>. All Rights Reserved.
+///
+/// This file is part of LSHBOX.
+///
+/// LSHBOX is free software: you can redistribute it and/or modify it under
+/// the terms of the GNU General Public License as published by the Free
+/// Software Foundation, either version 3 of the License, or(at your option)
+/// any later version.
+///
+/// LSHBOX is distributed in the hope that it will be useful, but WITHOUT
+/// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+/// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+/// more details.
+///
+/// You should have received a copy of the GNU General Public License along
+/// with LSHBOX. If not, see <http://www.gnu.org/licenses/>.
+///
+/// @version 0.1
+/// @author Gefu Tang & Zhifeng Xiao
+/// @date 2014.6.30
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @file itqlsh_layout_test.cpp
+ *
+ * @brief Check that every layout of the bucket files returns the same top K
+ * as the plain index built with one thread.
+ */
+#include "check.h"
+/**
+ * How an index is built and saved.
+ */
+struct Layout
+{
+    const char *name;
+    unsigned threads;
+    unsigned batchRows;
+    bool compress;
+    bool idOnly;
+    bool packed;
+    lshbox::Payload::Type payload;
+};
+/**
+ * Build the index of data with layout in a directory under root, trained
+ * with the same seed as every other layout, and return its path.
+ */
+std::string build(const std::string &root, lshbox::FileDB<float> &data, const Layout &layout)
+{
+    lshbox::itqLsh<float>::Parameter param;
+    param.L = 3;
+    param.D = data.getDim();
+    param.N = 8;
+    param.S = data.getSize();
+    param.I = 20;
+    lshbox::itqLsh<float> lsh(param);
+    lsh.setBatchRows(layout.batchRows);
+    lsh.setCompressKeys(layout.compress);
+    lsh.setIdOnly(layout.idOnly);
+    lsh.setPacked(layout.packed);
+    lsh.setPayload(layout.payload);
+    lsh.train(data, layout.threads, 7);
+    // ITQ lowers the quantization loss of vectors that are not all zero
+    for (unsigned k = 0; k != param.L; ++k)
+    {
+        const std::vector<float> &losses = lsh.getLosses()[k];
+        CHECK(losses.size() > 1 && losses.back() < losses.front());
+    }
+    lsh.hash(data, layout.threads);
+    std::string dir = root + "/" + layout.name;
+    _mkdir(dir.c_str());
+    CHECK(lsh.tablesToFiles(dir, data, 1, layout.threads));
+    return dir + "/" + lsh.getHashSavePath();
+}
+int main(int argc, char const *argv[])
+{
+    if (argc != 2)
+    {
+        std::cerr << "Usage: itqlsh_layout_test work_path" << std::endl;
+        return -1;
+    }
+    std::string root = freshDir(argv[1]);
+    const unsigned DIM = 16, SIZE = 6000, K = 10;
+    std::vector<float> vecs = makeVectors(SIZE, DIM, 1);
+    saveDataset(root + "/data", vecs, DIM, 0, SIZE);
+    lshbox::FileDB<float> data(root + "/data");
+    CHECK(sameDataset(data, vecs, 0, SIZE));
+    std::vector<unsigned> queries;
+    for (unsigned i = 0; i != 50; ++i)
+    {
+        queries.push_back(i * 97 % SIZE);
+    }
+    const Layout plain = {"plain", 1, 0, false, false, false, lshbox::Payload::FULL};
+    Results expected = query(build(root, data, plain), data, queries, K);
+    CHECK(expected.size() == queries.size() && expected[0].size() == K && expected[0][0].second == queries[0]);
+    const Layout layouts[] =
+    {
+        {"threads", 4, 0, false, false, false, lshbox::Payload::FULL},
+        {"compress", 1, 0, true, false, false, lshbox::Payload::FULL},
+        {"idonly", 1, 0, false, true, false, lshbox::Payload::FULL},
+        {"packed", 1, 0, false, false, true, lshbox::Payload::FULL},
+        {"all", 4, 0, true, true, true, lshbox::Payload::FULL},
+        {"batched", 1, SIZE / 4, false, false, false, lshbox::Payload::FULL},
+        {"half", 1, 0, false, false, false, lshbox::Payload::HALF},
+        {"int8", 1, 0, false, false, false, lshbox::Payload::INT8},
+        {"int8packed", 4, 0, false, true, true, lshbox::Payload::INT8}
+    };
+    for (unsigned i = 0; i != sizeof(layouts) / sizeof(layouts[0]); ++i)
+    {
+        const Layout &layout = layouts[i];
+        // the reduced vectors only rank the candidates, every one is ranked again
+        unsigned rerank = layout.payload == lshbox::Payload::FULL ? 0 : SIZE;
+        bool same = sameResults(expected, query(build(root, data, layout), data, queries, K, rerank));
+        std::cout << layout.name << ": " << (same ? "same" : "different") << std::endl;
+        CHECK(same);
+    }
+    return failures;
+}
@@ -0,0 +1,189 @@
+//////////////////////////////////////////////////////////////////////////////
+/// Copyright (C) 2014 Gefu Tang <tanggefu@gmail.com>. All Rights Reserved.
+///
+/// This file is part of LSHBOX.
+///
+/// LSHBOX is free software: you can redistribute it and/or modify it under
+/// the terms of the GNU General Public License as published by the Free
+/// Software Foundation, either version 3 of the License, or(at your option)
+/// any later version.
+///
+/// LSHBOX is distributed in the hope that it will be useful, but WITHOUT
+/// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+/// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+/// more details.
+///
+/// You should have received a copy of the GNU General Public License along
+/// with LSHBOX. If not, see <http://www.gnu.org/licenses/>.
+///
+/// @version 0.1
+/// @author Gefu Tang & Zhifeng Xiao
+/// @date 2014.6.30
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @file itqlsh_update_test.cpp
+ *
+ * @brief Check that vectors appended to an index, added as segments, deleted
+ * and merged return the same top K as an index of all the vectors built at
+ * once with the same projections.
+ */
+#include "check.h"
+/**
+ * How the indexes are saved.
+ */
+struct Layout
+{
+    const char *name;
+    bool idOnly;
+    bool packed;
+    lshbox::Payload::Type payload;
+};
+/**
+ * Hash data with lsh and save it in the directory dir, return the path of
+ * the index.
+ */
+std::string save(lshbox::itqLsh<float> &lsh, lshbox::FileDB<float> &data, const std::string &dir)
+{
+    lsh.hash(data, 2);
+    _mkdir(dir.c_str());
+    CHECK(lsh.tablesToFiles(dir, data, 1, 2));
+    return dir + "/" + lsh.getHashSavePath();
+}
+/**
+ * The results of all keys but those deleted, from results of K plus the
+ * number of deleted keys.
+ */
+Results withoutDeleted(const Results &results, const std::vector<unsigned> &deleted, unsigned K)
+{
+    Results kept(results.size());
+    for (unsigned i = 0; i != results.size(); ++i)
+    {
+        for (unsigned j = 0; j != results[i].size() && kept[i].size() != K; ++j)
+        {
+            if (std::find(deleted.begin(), deleted.end(), results[i][j].second) == deleted.end())
+            {
+                kept[i].push_back(results[i][j]);
+            }
+        }
+    }
+    return kept;
+}
+int main(int argc, char const *argv[])
+{
+    if (argc != 2)
+    {
+        std::cerr << "Usage: itqlsh_update_test work_path" << std::endl;
+        return -1;
+    }
+    std::string root = freshDir(argv[1]);
+    const unsigned DIM = 16, SIZE = 6000, K = 10;
+    // the first half is indexed at first, the two quarters that follow are added
+    const unsigned SPLIT[] = {0, SIZE / 2, SIZE * 3 / 4, SIZE};
+    std::vector<float> vecs = makeVectors(SIZE, DIM, 2);
+    saveDataset(root + "/all", vecs, DIM, 0, SIZE);
+    lshbox::FileDB<float> all(root + "/all");
+    CHECK(sameDataset(all, vecs, 0, SIZE));
+    std::vector<lshbox::FileDB<float> *> parts;
+    for (unsigned i = 0; i != 3; ++i)
+    {
+        std::string path = root + "/part" + std::to_string(long double(i));
+        saveDataset(path, vecs, DIM, SPLIT[i], SPLIT[i + 1]);
+        parts.push_back(new lshbox::FileDB<float>(path));
+        CHECK(sameDataset(*parts[i], vecs, SPLIT[i], SPLIT[i + 1]));
+    }
+    std::vector<unsigned> queries;
+    for (unsigned i = 0; i != 50; ++i)
+    {
+        queries.push_back(i * 97 % SIZE);
+    }
+    // keys of every part, some of them returned by the first queries
+    std::vector<unsigned> deleted;
+    deleted.push_back(queries[0]);
+    deleted.push_back(queries[1]);
+    deleted.push_back(SPLIT[1] + 7);
+    deleted.push_back(SPLIT[2] + 11);
+    const Layout layouts[] =
+    {
+        {"plain", false, false, lshbox::Payload::FULL},
+        {"packed", false, true, lshbox::Payload::FULL},
+        {"idonly", true, true, lshbox::Payload::FULL},
+        {"half", false, false, lshbox::Payload::HALF},
+        {"int8", true, false, lshbox::Payload::INT8}
+    };
+    for (unsigned l = 0; l != sizeof(layouts) / sizeof(layouts[0]); ++l)
+    {
+        const Layout &layout = layouts[l];
+        std::string dir = root + "/" + layout.name;
+        _mkdir(dir.c_str());
+        lshbox::itqLsh<float>::Parameter param;
+        param.L = 3;
+        param.D = DIM;
+        param.N = 8;
+        param.S = SPLIT[1];
+        param.I = 20;
+        lshbox::itqLsh<float> trained(param);
+        trained.setIdOnly(layout.idOnly);
+        trained.setPacked(layout.packed);
+        trained.setPayload(layout.payload);
+        trained.train(*parts[0], 2, 7);
+        unsigned rerank = layout.payload == lshbox::Payload::FULL ? 0 : SIZE;
+        lshbox::itqLsh<float> full(trained);
+        std::string fullPath = save(full, all, dir + "/full");
+        Results expected = query(fullPath, all, queries, K, rerank);
+        Results expectedDeleted = withoutDeleted(query(fullPath, all, queries, K + unsigned(deleted.size()), rerank), deleted, K);
+
+        lshbox::itqLsh<float> appended(trained);
+        std::string appendPath = save(appended, *parts[0], dir + "/append");
+        for (unsigned i = 1; i != 3; ++i)
+        {
+            lshbox::itqLsh<float> lsh;
+            CHECK(lsh.loadHashedFile(appendPath));
+            CHECK(lsh.appendToFiles(appendPath, *parts[i], 2));
+        }
+        bool append = sameResults(expected, query(appendPath, all, queries, K, rerank));
+        {
+            lshbox::itqSegments<float> lsh;
+            lsh.open(appendPath);
+            for (unsigned i = 0; i != deleted.size(); ++i)
+            {
+                CHECK(lsh.remove(deleted[i]));
+            }
+            CHECK(!lsh.remove(deleted[0]));
+        }
+        bool appendDeleted = sameResults(expectedDeleted, query(appendPath, all, queries, K, rerank));
+
+        lshbox::itqLsh<float> first(trained);
+        std::string segmentPath = save(first, *parts[0], dir + "/segments");
+        bool segments, segmentsDeleted;
+        {
+            lshbox::itqSegments<float> lsh;
+            lsh.open(segmentPath);
+            CHECK(lsh.add(*parts[1], 2));
+            CHECK(lsh.add(*parts[2], 2));
+            CHECK(lsh.getSegments().size() == 3 && lsh.getSize() == SIZE);
+            segments = sameResults(expected, query(segmentPath, all, queries, K, rerank));
+            for (unsigned i = 0; i != deleted.size(); ++i)
+            {
+                CHECK(lsh.remove(deleted[i]));
+            }
+            segmentsDeleted = sameResults(expectedDeleted, query(segmentPath, all, queries, K, rerank));
+            CHECK(lsh.compact(1, 2));
+            CHECK(lsh.getSegments().size() == 2 && lsh.getSize() == SIZE);
+        }
+        bool merged = sameResults(expectedDeleted, query(segmentPath, all, queries, K, rerank));
+        std::cout << layout.name << ": append " << append << ", append and delete " << appendDeleted
+                  << ", segments " << segments << ", segments and delete " << segmentsDeleted
+                  << ", merged " << merged << std::endl;
+        CHECK(append);
+        CHECK(appendDeleted);
+        CHECK(segments);
+        CHECK(segmentsDeleted);
+        CHECK(merged);
+    }
+    for (unsigned i = 0; i != parts.size(); ++i)
+    {
+        delete parts[i];
+    }
+    return failures;
+}
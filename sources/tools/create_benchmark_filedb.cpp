@@ -52,18 +52,30 @@ int main(int argc, char *argv[])
     bench.init(Q, K, data.getSize(), seed);
     lshbox::Metric<float> metric(data.getDim(), L2_DIST);
     timer.restart();
+    std::vector<std::vector<float> > queries(Q);
     for (unsigned i = 0; i != Q; ++i)
     {
-        unsigned q = bench.getQuery(i);
-        lshbox::Topk &topk = bench.getAnswer(i);
-        std::cout << "------------------------- " << i + 1 << "/" << Q << " -------------------------" << std::endl; 
-        lshbox::progress_display pd(data.getSize());
-        for (unsigned j = 0; j != data.getSize(); ++j)
+        queries[i] = data.getIthVec(bench.getQuery(i));
+    }
+    lshbox::progress_display pd(data.getSize());
+    lshbox::FileDB<float>::Reader reader(data, 0, data.getSize(), 0, true);
+    const float *vecs;
+    for (unsigned rows = reader.next(vecs); rows != 0; rows = reader.next(vecs))
+    {
+        unsigned begin = reader.position();
+        for (unsigned i = 0; i != Q; ++i)
         {
-            topk.push(j, metric.dist(&data.getIthVec(q)[0], &data.getIthVec(j)[0]));
-            ++pd;
+            lshbox::Topk &topk = bench.getAnswer(i);
+            for (unsigned j = 0; j != rows; ++j)
+            {
+                topk.push(begin + j, metric.dist(&queries[i][0], vecs + j * data.getDim()));
+            }
         }
-        topk.genTopk();
+        pd += rows;
+    }
+    for (unsigned i = 0; i != Q; ++i)
+    {
+        bench.getAnswer(i).genTopk();
     }
     std::cout << "MEAN QUERY TIME: " << timer.elapsed() / Q << "s." << std::endl;
     bench.save(ben_file);
@@ -0,0 +1,74 @@
+//////////////////////////////////////////////////////////////////////////////
+/// Copyright (C) 2014 Gefu Tang <tanggefu@gmail.com>. All Rights Reserved.
+///
+/// This file is part of LSHBOX.
+///
+/// LSHBOX is free software: you can redistribute it and/or modify it under
+/// the terms of the GNU General Public License as published by the Free
+/// Software Foundation, either version 3 of the License, or(at your option)
+/// any later version.
+///
+/// LSHBOX is distributed in the hope that it will be useful, but WITHOUT
+/// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+/// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+/// more details.
+///
+/// You should have received a copy of the GNU General Public License along
+/// with LSHBOX. If not, see <http://www.gnu.org/licenses/>.
+///
+/// @version 0.1
+/// @author Gefu Tang & Zhifeng Xiao
+/// @date 2014.6.30
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @file dbitq_append.cpp
+ *
+ * @brief Example of adding vectors to a saved Iterative Quantization LSH index.
+ */
+#include <lshbox.h>
+int main(int argc, char const *argv[])
+{
+    if (argc < 3 || argc > 4)
+    {
+        std::cerr << "Usage: dbitq_append data_path hashed_path [threads = 1]" << std::endl;
+        return -1;
+    }
+    std::cout << "Example of using Iterative Quantization" << std::endl << std::endl;
+    typedef float DATATYPE;
+    unsigned threads = 1;
+    if (argc > 3)
+    {
+        threads = atoi(argv[3]);
+    }
+    std::cout << "LOADING DATA ..." << std::endl;
+    lshbox::timer timer;
+    lshbox::FileDB<DATATYPE> data(argv[1]);
+    std::cout << "LOAD TIME: " << timer.elapsed() << "s." << std::endl;
+
+    std::cout << "LOADING INDEX ..." << std::endl;
+    timer.restart();
+    lshbox::itqLsh<DATATYPE> mylsh;
+    std::string hash_save_path(argv[2]);
+    struct stat st;
+    if (stat((hash_save_path + "/segments.list").c_str(), &st) == 0)
+    {
+        std::cerr << hash_save_path << " is made of segments, add the vectors with dbitq_ingest" << std::endl;
+        return -1;
+    }
+    if (!mylsh.loadHashedFile(hash_save_path))
+    {
+        std::cerr << "Can not load the index in " << hash_save_path << std::endl;
+        return -1;
+    }
+    std::cout << "LOADING TIME: " << timer.elapsed() << "s." << std::endl;
+
+    std::cout << "APPENDING " << data.getSize() << " VECTORS AFTER " << mylsh.getHashedSize() << " ..." << std::endl;
+    timer.restart();
+    if (!mylsh.appendToFiles(hash_save_path, data, threads))
+    {
+        std::cerr << "Can not save the index in " << hash_save_path << std::endl;
+        return -1;
+    }
+    std::cout << "APPENDING TIME: " << timer.elapsed() << "s." << std::endl;
+}
\ No newline at end of file
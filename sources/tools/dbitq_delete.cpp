@@ -0,0 +1,61 @@
+//////////////////////////////////////////////////////////////////////////////
+/// Copyright (C) 2014 Gefu Tang <tanggefu@gmail.com>. All Rights Reserved.
+///
+/// This file is part of LSHBOX.
+///
+/// LSHBOX is free software: you can redistribute it and/or modify it under
+/// the terms of the GNU General Public License as published by the Free
+/// Software Foundation, either version 3 of the License, or(at your option)
+/// any later version.
+///
+/// LSHBOX is distributed in the hope that it will be useful, but WITHOUT
+/// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+/// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+/// more details.
+///
+/// You should have received a copy of the GNU General Public License along
+/// with LSHBOX. If not, see <http://www.gnu.org/licenses/>.
+///
+/// @version 0.1
+/// @author Gefu Tang & Zhifeng Xiao
+/// @date 2014.6.30
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @file dbitq_delete.cpp
+ *
+ * @brief Example of deleting vectors from a saved Iterative Quantization LSH index.
+ */
+#include <lshbox.h>
+int main(int argc, char const *argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: dbitq_delete hashed_path key [key ...]" << std::endl;
+        return -1;
+    }
+    std::cout << "Example of using Iterative Quantization" << std::endl << std::endl;
+    typedef float DATATYPE;
+    std::cout << "LOADING INDEX ..." << std::endl;
+    lshbox::timer timer;
+    lshbox::itqSegments<DATATYPE> mylsh;
+    std::string hash_save_path(argv[1]);
+    mylsh.open(hash_save_path);
+    std::cout << "LOADING TIME: " << timer.elapsed() << "s." << std::endl;
+
+    unsigned deleted = 0;
+    for (int i = 2; i != argc; ++i)
+    {
+        unsigned key = atoi(argv[i]);
+        if (key >= mylsh.getSize())
+        {
+            std::cerr << "NO KEY " << key << " IN THE INDEX" << std::endl;
+            continue;
+        }
+        if (mylsh.remove(key))
+        {
+            ++deleted;
+        }
+    }
+    std::cout << "DELETED KEYS: " << deleted << std::endl;
+}
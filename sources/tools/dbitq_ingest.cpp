@@ -0,0 +1,75 @@
+//////////////////////////////////////////////////////////////////////////////
+/// Copyright (C) 2014 Gefu Tang <tanggefu@gmail.com>. All Rights Reserved.
+///
+/// This file is part of LSHBOX.
+///
+/// LSHBOX is free software: you can redistribute it and/or modify it under
+/// the terms of the GNU General Public License as published by the Free
+/// Software Foundation, either version 3 of the License, or(at your option)
+/// any later version.
+///
+/// LSHBOX is distributed in the hope that it will be useful, but WITHOUT
+/// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+/// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+/// more details.
+///
+/// You should have received a copy of the GNU General Public License along
+/// with LSHBOX. If not, see <http://www.gnu.org/licenses/>.
+///
+/// @version 0.1
+/// @author Gefu Tang & Zhifeng Xiao
+/// @date 2014.6.30
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @file dbitq_ingest.cpp
+ *
+ * @brief Example of adding vectors to a segmented Iterative Quantization LSH index.
+ */
+#include <lshbox.h>
+int main(int argc, char const *argv[])
+{
+    if (argc < 3 || argc > 5)
+    {
+        std::cerr << "Usage: dbitq_ingest data_path hashed_path [threads = 1] [max_segments = 0]" << std::endl;
+        return -1;
+    }
+    std::cout << "Example of using Iterative Quantization" << std::endl << std::endl;
+    typedef float DATATYPE;
+    unsigned threads = 1;
+    if (argc > 3)
+    {
+        threads = atoi(argv[3]);
+    }
+    std::cout << "LOADING DATA ..." << std::endl;
+    lshbox::timer timer;
+    lshbox::FileDB<DATATYPE> data(argv[1]);
+    std::cout << "LOAD TIME: " << timer.elapsed() << "s." << std::endl;
+
+    std::cout << "LOADING INDEX ..." << std::endl;
+    timer.restart();
+    lshbox::itqSegments<DATATYPE> mylsh;
+    mylsh.open(argv[2]);
+    std::cout << "LOADING TIME: " << timer.elapsed() << "s." << std::endl;
+
+    std::cout << "ADDING " << data.getSize() << " VECTORS AFTER " << mylsh.getSize() << " ..." << std::endl;
+    timer.restart();
+    if (!mylsh.add(data, threads))
+    {
+        std::cerr << "Can not save the new segment in " << argv[2] << std::endl;
+        return -1;
+    }
+    std::cout << "ADDING TIME: " << timer.elapsed() << "s." << std::endl;
+    if (argc > 4 && atoi(argv[4]) != 0)
+    {
+        std::cout << "MERGING SEGMENTS ..." << std::endl;
+        timer.restart();
+        if (!mylsh.compact(atoi(argv[4]), threads))
+        {
+            std::cerr << "Can not save the merged segments in " << argv[2] << std::endl;
+            return -1;
+        }
+        std::cout << "MERGING TIME: " << timer.elapsed() << "s." << std::endl;
+    }
+    std::cout << "SEGMENTS: " << mylsh.getSegments().size() << std::endl;
+}
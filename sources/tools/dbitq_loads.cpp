@@ -29,23 +29,24 @@
 #include <lshbox.h>
 int main(int argc, char const *argv[])
 {
-    if (argc != 6)
+    if (argc < 6 || argc > 8)
     {
-        std::cerr << "Usage: dbitq_loads data_path hashed_path benchmark_file max_memory hamming" << std::endl;
+        std::cerr << "Usage: dbitq_loads data_path hashed_path benchmark_file max_memory hamming [use_mmap = 0] [rerank = 0]" << std::endl;
         return -1;
     }
     std::cout << "Example of using Iterative Quantization" << std::endl << std::endl;
     typedef float DATATYPE;
     std::cout << "LOADING DATA ..." << std::endl;
     lshbox::timer timer;
-    lshbox::FileDB<DATATYPE> data(argv[1]);
+    lshbox::FileDB<DATATYPE> data(argv[1], argc > 6 && atoi(argv[6]) != 0);
+    data.advise(lshbox::MappedFile::RANDOM);
     std::cout << "LOAD TIME: " << timer.elapsed() << "s." << std::endl;
 
     std::cout << "CONSTRUCTING INDEX ..." << std::endl;
     timer.restart();
-    lshbox::itqLsh<DATATYPE> mylsh;
+    lshbox::itqSegments<DATATYPE> mylsh;
     std::string hash_save_path(argv[2]);
-    mylsh.loadHashedFile(hash_save_path);
+    mylsh.open(hash_save_path);
 
     std::cout << "CONSTRUCTING TIME: " << timer.elapsed() << "s." << std::endl;
 
@@ -57,26 +58,24 @@ int main(int argc, char const *argv[])
 
     lshbox::Metric<DATATYPE> metric(data.getDim(), L2_DIST);
     unsigned K = bench.getK();
-    lshbox::FilesScanner<DATATYPE> filesSanner(
-        mylsh.getTables(),
-        mylsh.getHashPos(),
-        mylsh.getFileSize(),
-        mylsh.getHashedSize(),
-        data.getDim(),
-        atoi(argv[4]) / mylsh.getSingleMax(),
-        hash_save_path,
-        metric,
-        K
-    );
+    if (argc > 7)
+    {
+        mylsh.setRerank(&data, atoi(argv[7]));
+    }
+    if (!mylsh.init(atoi(argv[4]) / mylsh.getIndex(0).getSingleMax(), metric, K))
+    {
+        std::cerr << "Can not read the bucket files of " << hash_save_path << std::endl;
+        return -1;
+    }
     std::cout << "RUNING QUERY ..." << std::endl;
     lshbox::Stat cost, recall;
     lshbox::progress_display pd(bench.getQ());
     timer.restart();
     for (unsigned i = 0; i != bench.getQ(); ++i)
     {
-        mylsh.fileQuery(&data.getIthVec(bench.getQuery(i))[0], filesSanner, atoi(argv[5]));
-        recall << bench.getAnswer(i).recall(filesSanner.topk());
-        cost << float(filesSanner.cnt()) / float(data.getSize());
+        mylsh.fileQuery(data[bench.getQuery(i)], atoi(argv[5]));
+        recall << bench.getAnswer(i).recall(mylsh.topk());
+        cost << float(mylsh.cnt()) / float(data.getSize());
         ++pd;
     }
     std::cout << "MEAN QUERY TIME: " << timer.elapsed() / bench.getQ() << "s." << std::endl;
@@ -0,0 +1,59 @@
+//////////////////////////////////////////////////////////////////////////////
+/// Copyright (C) 2014 Gefu Tang <tanggefu@gmail.com>. All Rights Reserved.
+///
+/// This file is part of LSHBOX.
+///
+/// LSHBOX is free software: you can redistribute it and/or modify it under
+/// the terms of the GNU General Public License as published by the Free
+/// Software Foundation, either version 3 of the License, or(at your option)
+/// any later version.
+///
+/// LSHBOX is distributed in the hope that it will be useful, but WITHOUT
+/// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+/// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+/// more details.
+///
+/// You should have received a copy of the GNU General Public License along
+/// with LSHBOX. If not, see <http://www.gnu.org/licenses/>.
+///
+/// @version 0.1
+/// @author Gefu Tang & Zhifeng Xiao
+/// @date 2014.6.30
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @file dbitq_merge.cpp
+ *
+ * @brief Example of merging the segments of a segmented Iterative Quantization LSH index.
+ */
+#include <lshbox.h>
+int main(int argc, char const *argv[])
+{
+    if (argc < 3 || argc > 4)
+    {
+        std::cerr << "Usage: dbitq_merge hashed_path max_segments [threads = 1]" << std::endl;
+        return -1;
+    }
+    std::cout << "Example of using Iterative Quantization" << std::endl << std::endl;
+    typedef float DATATYPE;
+    unsigned threads = 1;
+    if (argc > 3)
+    {
+        threads = atoi(argv[3]);
+    }
+    std::cout << "LOADING INDEX ..." << std::endl;
+    lshbox::timer timer;
+    lshbox::itqSegments<DATATYPE> mylsh;
+    mylsh.open(argv[1]);
+    std::cout << "LOADING TIME: " << timer.elapsed() << "s." << std::endl;
+
+    std::cout << "MERGING " << mylsh.getSegments().size() << " SEGMENTS ..." << std::endl;
+    timer.restart();
+    if (!mylsh.compact(atoi(argv[2]), threads))
+    {
+        std::cerr << "Can not save the merged segments in " << argv[1] << std::endl;
+        return -1;
+    }
+    std::cout << "MERGING TIME: " << timer.elapsed() << "s." << std::endl;
+    std::cout << "SEGMENTS: " << mylsh.getSegments().size() << std::endl;
+}
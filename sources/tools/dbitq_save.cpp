@@ -27,18 +27,110 @@
  * @brief Example of using Iterative Quantization LSH index for L2 distance.
  */
 #include <lshbox.h>
+static const char *USAGE =
+    "Usage: dbitq_save data_path param.L param.N hash_save_main_path single_max [options]\n"
+    "Options:\n"
+    "  --threads=1        threads used to build the index\n"
+    "  --mmap=0           memory map the dataset\n"
+    "  --tolerance=0      stop ITQ once the loss improves by less than this\n"
+    "  --full-pca=0       compute the PCA from the whole dataset\n"
+    "  --compress=0       keep the keys of the buckets compressed\n"
+    "  --split-bits=0     extra bits of the codes, needs --split-max\n"
+    "  --split-max=0      split the buckets holding more vectors, needs --split-bits\n"
+    "  --id-only=0        store the vectors only in the first table\n"
+    "  --payload=0        encoding of the vectors, 0 full, 1 16 bits, 2 bytes\n"
+    "  --packed=0         pack the bucket files of every table into one file";
 int main(int argc, char const *argv[])
 {
-    if (argc != 6)
+    if (argc < 6)
     {
-        std::cerr << "Usage: dbitq_save data_path param.L param.N hash_save_main_path single_max" << std::endl;
+        std::cerr << USAGE << std::endl;
+        return -1;
+    }
+    unsigned threads = 1;
+    bool use_mmap = false;
+    float tolerance = 0;
+    bool full_pca = false;
+    bool compress_keys = false;
+    unsigned split_bits = 0, split_max = 0;
+    bool split_bits_set = false, split_max_set = false;
+    bool id_only = false;
+    unsigned payload = lshbox::Payload::FULL;
+    bool packed = false;
+    for (int i = 6; i != argc; ++i)
+    {
+        std::string arg(argv[i]);
+        size_t equal = arg.find('=');
+        if (equal == std::string::npos || equal + 1 == arg.size())
+        {
+            std::cerr << "Option " << arg << " needs a value, e.g. --threads=8" << std::endl;
+            return -1;
+        }
+        std::string name = arg.substr(0, equal);
+        const char *value = argv[i] + equal + 1;
+        if (name == "--threads")
+        {
+            threads = atoi(value);
+        }
+        else if (name == "--mmap")
+        {
+            use_mmap = atoi(value) != 0;
+        }
+        else if (name == "--tolerance")
+        {
+            tolerance = float(atof(value));
+        }
+        else if (name == "--full-pca")
+        {
+            full_pca = atoi(value) != 0;
+        }
+        else if (name == "--compress")
+        {
+            compress_keys = atoi(value) != 0;
+        }
+        else if (name == "--split-bits")
+        {
+            split_bits = atoi(value);
+            split_bits_set = true;
+        }
+        else if (name == "--split-max")
+        {
+            split_max = atoi(value);
+            split_max_set = true;
+        }
+        else if (name == "--id-only")
+        {
+            id_only = atoi(value) != 0;
+        }
+        else if (name == "--payload")
+        {
+            payload = atoi(value);
+        }
+        else if (name == "--packed")
+        {
+            packed = atoi(value) != 0;
+        }
+        else
+        {
+            std::cerr << "Unknown option " << arg << std::endl << USAGE << std::endl;
+            return -1;
+        }
+    }
+    if (split_bits_set != split_max_set)
+    {
+        std::cerr << "--split-bits and --split-max must be given together" << std::endl;
+        return -1;
+    }
+    if (payload > lshbox::Payload::INT8)
+    {
+        std::cerr << "Unknown payload " << payload << std::endl;
         return -1;
     }
     std::cout << "Example of using Iterative Quantization" << std::endl << std::endl;
     typedef float DATATYPE;
     std::cout << "LOADING DATA ..." << std::endl;
     lshbox::timer timer;
-    lshbox::FileDB<DATATYPE> data(argv[1]);
+    lshbox::FileDB<DATATYPE> data(argv[1], use_mmap);
     std::cout << "LOAD TIME: " << timer.elapsed() << "s." << std::endl;
     std::cout << "CONSTRUCTING INDEX ..." << std::endl;
     timer.restart();
@@ -49,14 +141,32 @@ int main(int argc, char const *argv[])
     param.L = atoi(argv[2]);
     param.D = data.getDim();
     param.N = atoi(argv[3]);
+    if (param.N + split_bits > lshbox::HashCode::MAX_BITS)
+    {
+        std::cerr << "Codes of more than " << lshbox::HashCode::MAX_BITS << " bits need a build with a larger LSHBOX_CODE_WORDS" << std::endl;
+        return -1;
+    }
     param.S = 50000;
     param.I = 100;
     mylsh.reset(param);
-    mylsh.train(data);
-    mylsh.hash(data);
+    mylsh.setTolerance(tolerance);
+    mylsh.setFullPca(full_pca);
+    mylsh.setCompressKeys(compress_keys);
+    mylsh.setSplitBuckets(split_bits, split_max);
+    mylsh.setIdOnly(id_only);
+    mylsh.setPayload(lshbox::Payload::Type(payload));
+    mylsh.setPacked(packed);
+    data.advise(lshbox::MappedFile::RANDOM);
+    mylsh.train(data, threads);
+    data.advise(lshbox::MappedFile::SEQUENTIAL);
+    mylsh.hash(data, threads);
 
     std::string hash_save_main_path(argv[4]);
-    mylsh.tablesToFiles(hash_save_main_path, data, atoi(argv[5]));
+    if (!mylsh.tablesToFiles(hash_save_main_path, data, atoi(argv[5]), threads))
+    {
+        std::cerr << "Can not save the index in " << hash_save_main_path << std::endl;
+        return -1;
+    }
 
 
     std::cout << "CONSTRUCTING TIME: " << timer.elapsed() << "s." << std::endl;